@@ -104,6 +104,8 @@ static int configListen(WebdavdConfiguration * config, xmlTextReaderPtr reader,
 					}
 					xmlFree((char *) encryptionString);
 				}
+			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "client-ca")) {
+				result = readConfigString(reader, &config->daemons[index].clientCAFile);
 			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "forward-to")) {
 				int depth2 = xmlTextReaderDepth(reader) + 1;
 				result = stepInto(reader);
@@ -158,6 +160,12 @@ static int configListen(WebdavdConfiguration * config, xmlTextReaderPtr reader,
 static int configSessionTimeout(WebdavdConfiguration * config, xmlTextReaderPtr reader,
 		const char * configFile) {
 	//<session-timeout>5:00</session-timeout>
+	return readConfigTime(reader, &config->rapSessionTimeout, configFile);
+}
+
+static int configSessionMaxLife(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	//<session-max-life>1:00:00</session-max-life>
 	return readConfigTime(reader, &config->rapMaxSessionLife, configFile);
 }
 
@@ -167,6 +175,79 @@ static int configMaxIpConnections(WebdavdConfiguration * config, xmlTextReaderPt
 	return readConfigInt(reader, &config->maxConnectionsPerIp, configFile);
 }
 
+static int configAuthFailureCache(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <auth-failure-cache>1:00</auth-failure-cache>
+	return readConfigTime(reader, &config->authFailureCacheTime, configFile);
+}
+
+static int configAuthMaxBackoff(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <auth-max-backoff>30</auth-max-backoff>
+	return readConfigTime(reader, &config->authMaxBackoff, configFile);
+}
+
+static int configAuthTimeout(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <auth-timeout>10</auth-timeout>
+	return readConfigTime(reader, &config->authTimeout, configFile);
+}
+
+static int configAuthWorkers(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <auth-workers>2</auth-workers>
+	return readConfigInt(reader, &config->authWorkers, configFile);
+}
+
+static int configMaxConcurrentAuth(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <max-concurrent-auth>16</max-concurrent-auth>
+	return readConfigInt(reader, &config->maxConcurrentAuth, configFile);
+}
+
+static int configDurability(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <durability>none</durability>
+	int result = readConfigString(reader, &config->durability);
+	if (config->durability && strcmp(config->durability, "none") && strcmp(config->durability, "fdatasync")
+			&& strcmp(config->durability, "group-commit")) {
+		stdLogError(0, "invalid durability %s in %s", config->durability, configFile);
+		exit(1);
+	}
+	return result;
+}
+
+static int configIpcTransport(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <ipc-transport>socket</ipc-transport>
+	const char * transportString;
+	int result = stepOverText(reader, &transportString);
+	if (transportString) {
+		if (!strcmp(transportString, "socket")) {
+			config->rapSharedMemory = 0;
+		} else if (!strcmp(transportString, "shared-memory")) {
+			config->rapSharedMemory = 1;
+		} else {
+			stdLogError(0, "invalid ipc-transport %s in %s", transportString, configFile);
+			exit(1);
+		}
+		xmlFree((char *) transportString);
+	}
+	return result;
+}
+
+static int configMaxSessions(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
+	// <max-sessions>256</max-sessions>
+	return readConfigInt(reader, &config->rapMaxSessions, configFile);
+}
+
+static int configMaxUserSessions(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <max-user-sessions>32</max-user-sessions>
+	return readConfigInt(reader, &config->rapMaxUserSessions, configFile);
+}
+
+static int configPropFindMaxEntries(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	// <propfind-max-entries>100000</propfind-max-entries>
+	return readConfigInt(reader, &config->propFindMaxEntries, configFile);
+}
+
 static int configRapTimeout(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	// <rap-timeout>2:00</rap-timeout>
 	return readConfigTime(reader, &config->rapTimeoutRead, configFile);
@@ -255,6 +336,38 @@ static int configConfigSSLCert(WebdavdConfiguration * config, xmlTextReaderPtr r
 	return result;
 }
 
+static int configCertificateUser(WebdavdConfiguration * config, xmlTextReaderPtr reader,
+		const char * configFile) {
+	//<certificate-user><subject>CN=backup,O=Example</subject><user>backup</user></certificate-user>
+	int index = config->certificateUserCount++;
+	config->certificateUsers = reallocSafe(config->certificateUsers,
+			sizeof(*config->certificateUsers) * config->certificateUserCount);
+	config->certificateUsers[index].subject = NULL;
+	config->certificateUsers[index].user = NULL;
+	int depth = xmlTextReaderDepth(reader) + 1;
+	int result = stepInto(reader);
+	while (result && xmlTextReaderDepth(reader) == depth) {
+		if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT
+				&& !strcmp(xmlTextReaderConstNamespaceUri(reader),
+				CONFIG_NAMESPACE)) {
+			if (!strcmp(xmlTextReaderConstLocalName(reader), "subject")) {
+				result = readConfigString(reader, &config->certificateUsers[index].subject);
+			} else if (!strcmp(xmlTextReaderConstLocalName(reader), "user")) {
+				result = readConfigString(reader, &config->certificateUsers[index].user);
+			} else {
+				result = stepOver(reader);
+			}
+		} else {
+			result = stepOver(reader);
+		}
+	}
+	if (!config->certificateUsers[index].subject || !config->certificateUsers[index].user) {
+		stdLogError(0, "certificate-user must specify both subject and user in %s", configFile);
+		exit(1);
+	}
+	return result;
+}
+
 static int configResponseDir(WebdavdConfiguration * config, xmlTextReaderPtr reader, const char * configFile) {
 	if (config->staticResponseDir) {
 		xmlFree((char *) config->staticResponseDir);
@@ -290,16 +403,28 @@ static int compareConfigFunction(const void * a, const void * b) {
 // This MUST be sorted in aplabetical order (for nodeName).  The array is binary-searched.
 static const ConfigurationFunction configFunctions[] = {
 		{ .nodeName = "access-log", .func = &configAccessLog },                // <access-log />
+		{ .nodeName = "auth-failure-cache", .func = &configAuthFailureCache }, // <auth-failure-cache />
+		{ .nodeName = "auth-max-backoff", .func = &configAuthMaxBackoff },     // <auth-max-backoff />
+		{ .nodeName = "auth-timeout", .func = &configAuthTimeout },            // <auth-timeout />
+		{ .nodeName = "auth-workers", .func = &configAuthWorkers },            // <auth-workers />
+		{ .nodeName = "certificate-user", .func = &configCertificateUser },    // <certificate-user />
 		{ .nodeName = "chroot-path", .func = &configChroot },                  // <chroot />
+		{ .nodeName = "durability", .func = &configDurability },               // <durability />
 		{ .nodeName = "error-log", .func = &configErrorLog },                  // <error-log />
+		{ .nodeName = "ipc-transport", .func = &configIpcTransport },          // <ipc-transport />
 		{ .nodeName = "listen", .func = &configListen },                       // <listen />
+		{ .nodeName = "max-concurrent-auth", .func = &configMaxConcurrentAuth }, // <max-concurrent-auth />
 		{ .nodeName = "max-ip-connections", .func = &configMaxIpConnections }, // <max-ip-connections />
 		{ .nodeName = "max-lock-time", .func = &configMaxLockTime },           // <max-lock-time />
+		{ .nodeName = "max-sessions", .func = &configMaxSessions },            // <max-sessions />
+		{ .nodeName = "max-user-sessions", .func = &configMaxUserSessions },   // <max-user-sessions />
 		{ .nodeName = "mime-file", .func = &configMimeFile },                  // <mime-file />
 		{ .nodeName = "pam-service", .func = &configPamService },              // <pam-service />
+		{ .nodeName = "propfind-max-entries", .func = &configPropFindMaxEntries }, // <propfind-max-entries />
 		{ .nodeName = "rap-binary", .func = &configRapBinary },                // <rap-binary />
 		{ .nodeName = "rap-timeout", .func = &configRapTimeout },              // <rap-timeout />
 		{ .nodeName = "restricted", .func = &configRestricted },               // <restricted />
+		{ .nodeName = "session-max-life", .func = &configSessionMaxLife },     // <session-max-life />
 		{ .nodeName = "session-timeout", .func = &configSessionTimeout },      // <session-timeout />
 		{ .nodeName = "ssl-cert", .func = &configConfigSSLCert },              // <ssl-cert />
 		{ .nodeName = "static-response-dir", .func = &configResponseDir }      // <static-response-dir />
@@ -337,8 +462,35 @@ static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reade
 	if (!config->maxConnectionsPerIp) {
 		config->maxConnectionsPerIp = 50;
 	}
+	if (!config->rapSessionTimeout) {
+		config->rapSessionTimeout = 60 * 5;
+	}
 	if (!config->rapMaxSessionLife) {
-		config->rapMaxSessionLife = 60 * 5;
+		config->rapMaxSessionLife = 60 * 60;
+	}
+	if (!config->authFailureCacheTime) {
+		config->authFailureCacheTime = 60;
+	}
+	if (!config->authMaxBackoff) {
+		config->authMaxBackoff = 30;
+	}
+	if (!config->authWorkers) {
+		config->authWorkers = 2;
+	}
+	if (!config->maxConcurrentAuth) {
+		config->maxConcurrentAuth = 16;
+	}
+	if (!config->authTimeout) {
+		config->authTimeout = 10;
+	}
+	if (!config->rapMaxSessions) {
+		config->rapMaxSessions = 256;
+	}
+	if (!config->rapMaxUserSessions) {
+		config->rapMaxUserSessions = 32;
+	}
+	if (!config->propFindMaxEntries) {
+		config->propFindMaxEntries = 100000;
 	}
 	if (!config->rapTimeoutRead) {
 		config->rapTimeoutRead = 120;
@@ -355,6 +507,9 @@ static int configureServer(WebdavdConfiguration * config, xmlTextReaderPtr reade
 	if (!config->pamServiceName) {
 		config->pamServiceName = "webdavd";
 	}
+	if (!config->durability) {
+		config->durability = "none";
+	}
 	if (!config->maxLockTime) {
 		config->maxLockTime = 60;
 	}
@@ -14,8 +14,14 @@ typedef struct DaemonConfig {
 	int forwardToIsEncrypted;
 	int forwardToPort;
 	const char * forwardToHost;
+	const char * clientCAFile;
 } DaemonConfig;
 
+typedef struct CertificateUser {
+	const char * subject;
+	const char * user;
+} CertificateUser;
+
 typedef struct SSLConfig {
 	int chainFileCount;
 	const char * keyFile;
@@ -34,10 +40,29 @@ typedef struct WebdavdConfiguration {
 	int maxConnectionsPerIp;
 
 	// RAP
+	time_t rapSessionTimeout;
 	time_t rapMaxSessionLife;
 	time_t rapTimeoutRead;
+	int rapMaxSessions;
+	int rapMaxUserSessions;
+	int rapSharedMemory;
+	const char * durability;
+	int propFindMaxEntries;
 	const char * pamServiceName;
 
+	// Client certificates
+	int certificateUserCount;
+	CertificateUser * certificateUsers;
+
+	// Failed authentication
+	time_t authFailureCacheTime;
+	time_t authMaxBackoff;
+
+	// Authentication workers
+	int authWorkers;
+	int maxConcurrentAuth;
+	time_t authTimeout;
+
 	// Max lock time
 	time_t maxLockTime;
 
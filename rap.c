@@ -1,5 +1,6 @@
 #include "shared.h"
 #include "xml.h"
+#include "uring.h"
 
 //#include <stdio.h>
 #include <unistd.h>
@@ -13,6 +14,13 @@
 #include <locale.h>
 #include <security/pam_appl.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <search.h>
+#include <inttypes.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#include <limits.h>
+#include <stddef.h>
 
 #define WEBDAV_NAMESPACE "DAV:"
 #define EXTENSIONS_NAMESPACE "urn:couling-webdav:"
@@ -209,10 +217,19 @@ static void initializeMimeTypes(const char * mimeTypesFile) {
 // Error Response //
 ////////////////////
 
+// Pipes carrying response bodies back to webdavd are enlarged so that a typical response can be written without
+// waiting for webdavd to read it.  If the pipe can't be enlarged (eg: the user's pipe quota is used up) the default
+// size is used.
+static int openResponsePipe(int pipeEnds[2]) {
+	if (pipe(pipeEnds)) return -1;
+	fcntl(pipeEnds[PIPE_WRITE], F_SETPIPE_SZ, RESPONSE_PIPE_SIZE);
+	return 0;
+}
+
 static ssize_t writeErrorResponse(RapConstant responseCode, const char * textError, const char * error,
 		const char * file) {
 	int pipeEnds[2];
-	if (pipe(pipeEnds)) {
+	if (openResponsePipe(pipeEnds)) {
 		stdLogError(errno, "Could not create pipe to write content");
 		return respond(RAP_RESPOND_INTERNAL_ERROR);
 	}
@@ -333,7 +350,7 @@ static void parseLockRequest(int fd, LockRequest * lockRequest) {
 static ssize_t writeLockResponse(const char * fileName, LockRequest * request, const char * lockToken,
 		time_t timeout) {
 	int pipeEnds[2];
-	if (pipe(pipeEnds)) {
+	if (openResponsePipe(pipeEnds)) {
 		stdLogError(errno, "Could not create pipe to write content");
 		return respond(RAP_RESPOND_INTERNAL_ERROR);
 	}
@@ -486,6 +503,165 @@ static ssize_t lockFile(Message * message) {
 // End Lock //
 //////////////
 
+/////////////////////
+// Dead Properties //
+/////////////////////
+
+// Properties set with PROPPATCH that the server doesn't manage itself are kept in extended attributes in the user
+// namespace, one per property, named "user.webdav.{namespace}name".  The value is the property element exactly as
+// the client sent it (with any namespace declarations it needs) so it can be written back into a response as is.
+
+#define DEAD_PROPERTY_PREFIX "user.webdav."
+#define DEAD_PROPERTY_BUFFER_SIZE 65536
+
+// Returns the attribute name for the property (to be freed) even if it is too long to ever be stored.
+static char * formatDeadPropertyName(const char * namespace, const char * localName) {
+	size_t size = sizeof(DEAD_PROPERTY_PREFIX) + strlen(namespace) + strlen(localName) + 2;
+	char * name = mallocSafe(size);
+	snprintf(name, size, DEAD_PROPERTY_PREFIX "{%s}%s", namespace, localName);
+	return name;
+}
+
+// Returns the attribute name for the property (to be freed) or NULL if it is too long to be stored.
+static char * deadPropertyName(const char * namespace, const char * localName) {
+	size_t size = sizeof(DEAD_PROPERTY_PREFIX) + strlen(namespace) + strlen(localName) + 2;
+	if (size > XATTR_NAME_MAX + 1) return NULL;
+	return formatDeadPropertyName(namespace, localName);
+}
+
+static int isDeadPropertyName(const char * name) {
+	return !strncmp(name, DEAD_PROPERTY_PREFIX "{", sizeof(DEAD_PROPERTY_PREFIX));
+}
+
+// Writes an empty element for a property.
+static void writePropertyName(XmlStream * stream, const char * namespace, size_t namespaceSize,
+		const char * localName) {
+	char namespaceString[namespaceSize + 1];
+	memcpy(namespaceString, namespace, namespaceSize);
+	namespaceString[namespaceSize] = '\0';
+	if (namespaceSize) {
+		xmlStreamWriteLiteral(stream, "<p:");
+		xmlStreamWriteText(stream, localName);
+		xmlStreamWriteLiteral(stream, " xmlns:p=\"");
+		xmlStreamWriteText(stream, namespaceString);
+		xmlStreamWriteLiteral(stream, "\"/>");
+	} else {
+		xmlStreamWriteLiteral(stream, "<");
+		xmlStreamWriteText(stream, localName);
+		xmlStreamWriteLiteral(stream, " xmlns=\"\"/>");
+	}
+}
+
+// Writes an empty element for the property stored in the attribute name.  The namespace may itself contain '}'
+// but the local name (an NCName) can't so the name is split at the last one.
+static void writeDeadPropertyName(XmlStream * stream, const char * name) {
+	const char * namespace = name + sizeof(DEAD_PROPERTY_PREFIX);
+	const char * end = strrchr(namespace, '}');
+	if (end) {
+		writePropertyName(stream, namespace, end - namespace, end + 1);
+	}
+}
+
+static void flagDeadPropertyError(void * arg, const xmlError * error) {
+	// A namespace that isn't a valid URI (eg: one containing '}') doesn't make the value any less safe to copy
+	if (error->code != XML_WAR_NS_URI && error->code != XML_WAR_NS_URI_RELATIVE) {
+		*((int *) arg) = 1;
+	}
+}
+
+// Anyone who can write to a file can set its attributes so a value is only copied into a response if it is exactly
+// one well formed element, with every namespace it uses declared, named as the attribute says.  Anything else
+// could break the response or forge parts of it.
+static int isValidDeadProperty(const char * name, const char * value, size_t valueSize) {
+	const char * namespace = name + sizeof(DEAD_PROPERTY_PREFIX);
+	const char * localName = strrchr(namespace, '}');
+	if (!localName || valueSize < 2 || valueSize > INT_MAX || value[0] != '<' || value[1] == '?') return 0;
+	size_t namespaceSize = localName - namespace;
+	localName++;
+
+	xmlTextReaderPtr reader = xmlReaderForMemory(value, valueSize, NULL, NULL, XML_PARSE_NONET);
+	if (!reader) return 0;
+	int error = 0;
+	xmlTextReaderSetStructuredErrorHandler(reader, (xmlStructuredErrorFunc) &flagDeadPropertyError, &error);
+	int readResult = xmlTextReaderRead(reader);
+	int valid = readResult == 1 && xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT;
+	if (valid) {
+		const char * elementNamespace = xmlTextReaderConstNamespaceUri(reader);
+		if (!elementNamespace) elementNamespace = "";
+		valid = strlen(elementNamespace) == namespaceSize && !strncmp(elementNamespace, namespace, namespaceSize)
+				&& !strcmp(xmlTextReaderConstLocalName(reader), localName);
+	}
+	while (valid && (readResult = xmlTextReaderRead(reader)) == 1) {
+		// Nothing may follow the element
+		valid = xmlTextReaderDepth(reader) > 0 || xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT;
+	}
+	xmlFreeTextReader(reader);
+	return valid && readResult == 0 && !error;
+}
+
+// Writes every dead property of path.  Each entry costs a single listxattr() plus a getxattr() for each of its
+// properties.
+static void writeAllDeadProperties(XmlStream * stream, const char * path) {
+	static char names[DEAD_PROPERTY_BUFFER_SIZE];
+	static char value[DEAD_PROPERTY_BUFFER_SIZE];
+	ssize_t namesSize = listxattr(path, names, sizeof(names));
+	if (namesSize == -1) {
+		if (errno != ENOTSUP && errno != ENOENT) {
+			stdLogError(errno, "Could not list properties of %s", path);
+		}
+		return;
+	}
+	for (const char * name = names; name < names + namesSize; name += strlen(name) + 1) {
+		if (isDeadPropertyName(name)) {
+			ssize_t valueSize = getxattr(path, name, value, sizeof(value));
+			if (valueSize > 0 && isValidDeadProperty(name, value, valueSize)) {
+				xmlStreamWrite(stream, value, valueSize);
+			} else if (valueSize > 0) {
+				stdLogError(0, "Ignoring malformed property %s of %s", name, path);
+			}
+		}
+	}
+}
+
+// Writes the named dead properties of path that exist (and are valid).  found[i] is set to say whether names[i] was written.
+static void writeDeadProperties(XmlStream * stream, const char * path, char * const * names, size_t count,
+		char * found) {
+	static char value[DEAD_PROPERTY_BUFFER_SIZE];
+	for (size_t i = 0; i < count; i++) {
+		ssize_t valueSize = getxattr(path, names[i], value, sizeof(value));
+		found[i] = valueSize > 0 && isValidDeadProperty(names[i], value, valueSize);
+		if (found[i]) {
+			xmlStreamWrite(stream, value, valueSize);
+		} else if (valueSize > 0) {
+			stdLogError(0, "Ignoring malformed property %s of %s", names[i], path);
+		}
+	}
+}
+
+// Copies every dead property of source to target, or to targetFd if it isn't -1.  Failures are logged but otherwise
+// ignored since the target file system may not support them.
+static void copyDeadProperties(const char * source, const char * target, int targetFd) {
+	char * names = mallocSafe(DEAD_PROPERTY_BUFFER_SIZE);
+	char * value = mallocSafe(DEAD_PROPERTY_BUFFER_SIZE);
+	ssize_t namesSize = llistxattr(source, names, DEAD_PROPERTY_BUFFER_SIZE);
+	if (namesSize == -1) namesSize = 0;
+	for (const char * name = names; name < names + namesSize; name += strlen(name) + 1) {
+		if (isDeadPropertyName(name)) {
+			ssize_t valueSize = lgetxattr(source, name, value, DEAD_PROPERTY_BUFFER_SIZE);
+			if (valueSize != -1 && (targetFd != -1 ? fsetxattr(targetFd, name, value, valueSize, 0) :
+					lsetxattr(target, name, value, valueSize, 0)) == -1) {
+				stdLogError(errno, "Could not copy property %s from %s to %s", name, source, target);
+			}
+		}
+	}
+	freeSafe(names);
+	freeSafe(value);
+}
+
+/////////////////////////
+// End Dead Properties //
+/////////////////////////
+
 //////////////
 // PROPFIND //
 //////////////
@@ -500,6 +676,19 @@ static ssize_t lockFile(Message * message) {
 #define PROPFIND_AVAILABLE_BYTES "quota-available-bytes"
 #define PROPFIND_ETAG "getetag"
 #define PROPFIND_WINDOWS_ATTRIBUTES "Win32FileAttributes"
+#define PROPFIND_WINDOWS_MODIFIED_TIME "Win32LastModifiedTime"
+#define PROPFIND_WINDOWS_ACCESS_TIME "Win32LastAccessTime"
+#define PROPFIND_UPLOADED_RANGES "uploaded-ranges"
+
+// The byte ranges written by PUTs with a Content-Range (see writeFileRange), kept sorted and merged.  This is not a
+// dead property so clients can neither see it as one nor change it.
+#define UPLOADED_RANGES_ATTRIBUTE "user.webdavd.uploaded-ranges"
+#define MAX_UPLOADED_RANGES 4096
+
+typedef struct UploadedRange {
+	uint64_t first;
+	uint64_t last;
+} UploadedRange;
 
 typedef struct PropertySet {
 	char creationDate;
@@ -512,8 +701,100 @@ typedef struct PropertySet {
 	char usedBytes;
 	char availableBytes;
 	char windowsHidden;
+	char windowsModifiedTime;
+	char windowsAccessTime;
+	char uploadedRanges;
+	char allDeadProperties;
+	// The attribute names of the dead properties asked for
+	size_t deadPropertyCount;
+	char ** deadProperties;
+	// More were asked for than will be looked up; the request is refused rather than answered without them
+	char tooManyDeadProperties;
 } PropertySet;
 
+// No more than this many dead properties are looked up by name for each entry
+#define PROPFIND_MAX_DEAD_PROPERTIES 256
+
+// allprop: every live property and every dead one
+static void setAllProperties(PropertySet * properties) {
+	memset(properties, 0, sizeof(*properties));
+	memset(properties, 1, offsetof(PropertySet, allDeadProperties) + 1);
+	// Only reported when asked for by name since it costs an extra lookup per file
+	properties->uploadedRanges = 0;
+}
+
+static void freePropertySet(PropertySet * properties) {
+	for (size_t i = 0; i < properties->deadPropertyCount; i++) {
+		freeSafe(properties->deadProperties[i]);
+	}
+	freeSafe(properties->deadProperties);
+	properties->deadPropertyCount = 0;
+	properties->deadProperties = NULL;
+}
+
+static void addDeadProperty(PropertySet * properties, const char * namespace, const char * localName) {
+	if (properties->deadPropertyCount == PROPFIND_MAX_DEAD_PROPERTIES) {
+		properties->tooManyDeadProperties = 1;
+		return;
+	}
+	// A name too long to store is still looked up (and reported as not found)
+	char * name = formatDeadPropertyName(namespace, localName);
+	if (!(properties->deadPropertyCount & 0xF)) {
+		properties->deadProperties = reallocSafe(properties->deadProperties,
+				sizeof(*properties->deadProperties) * (properties->deadPropertyCount + 0x10));
+	}
+	properties->deadProperties[properties->deadPropertyCount++] = name;
+}
+
+// Reads the names of the properties requested in a <d:prop> element (the reader's current node) into properties.
+static int readPropElement(xmlTextReaderPtr reader, PropertySet * properties) {
+	int depth = xmlTextReaderDepth(reader);
+	int readResult;
+	readResult = stepInto(reader);
+	while (readResult && xmlTextReaderDepth(reader) > depth) {
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+			readResult = stepOver(reader);
+			continue;
+		}
+		const char * namespace = xmlTextReaderConstNamespaceUri(reader);
+		const char * nodeName = xmlTextReaderConstLocalName(reader);
+		if (!namespace) namespace = "";
+		if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_RESOURCE_TYPE)) {
+			properties->resourceType = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_CREATION_DATE)) {
+			properties->creationDate = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_CONTENT_LENGTH)) {
+			properties->contentLength = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_LAST_MODIFIED)) {
+			properties->lastModified = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_DISPLAY_NAME)) {
+			properties->displayName = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_CONTENT_TYPE)) {
+			properties->contentType = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_AVAILABLE_BYTES)) {
+			properties->availableBytes = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_USED_BYTES)) {
+			properties->usedBytes = 1;
+		} else if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(nodeName, PROPFIND_ETAG)) {
+			properties->etag = 1;
+		} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(nodeName, PROPFIND_WINDOWS_ATTRIBUTES)) {
+			properties->windowsHidden = 1;
+		} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(nodeName, PROPFIND_WINDOWS_MODIFIED_TIME)) {
+			properties->windowsModifiedTime = 1;
+		} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(nodeName, PROPFIND_WINDOWS_ACCESS_TIME)) {
+			properties->windowsAccessTime = 1;
+		} else if (!strcmp(namespace, EXTENSIONS_NAMESPACE) && !strcmp(nodeName, PROPFIND_UPLOADED_RANGES)) {
+			properties->uploadedRanges = 1;
+		} else {
+			// Anything else can only be a dead property (and if it isn't it will be reported as not found)
+			addDeadProperty(properties, namespace, nodeName);
+		}
+		readResult = stepOver(reader);
+	}
+
+	return readResult;
+}
+
 static int parsePropFind(int fd, PropertySet * properties) {
 	xmlTextReaderPtr reader = xmlReaderForFd(fd, NULL, NULL, XML_PARSE_NOENT);
 	xmlReaderSuppressErrors(reader);
@@ -529,7 +810,7 @@ static int parsePropFind(int fd, PropertySet * properties) {
 	if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_NONE) {
 		// No body has been sent
 		// so assume the client is asking for everything.
-		memset(properties, 1, sizeof(*properties));
+		setAllProperties(properties);
 		xmlFreeTextReader(reader);
 		close(fd);
 		return 1;
@@ -545,48 +826,23 @@ static int parsePropFind(int fd, PropertySet * properties) {
 	}
 
 	readResult = stepInto(reader);
-	while (readResult && xmlTextReaderDepth(reader) > 0 && !elementMatches(reader, WEBDAV_NAMESPACE, "prop")) {
-		stepOver(reader);
-	}
-
 	if (!readResult) {
 		xmlFreeTextReader(reader);
 		close(fd);
 		return 0;
 	}
 
-	readResult = stepInto(reader);
-	while (readResult && xmlTextReaderDepth(reader) > 1) {
-		if (!strcmp(xmlTextReaderConstNamespaceUri(reader), WEBDAV_NAMESPACE)) {
-			const char * nodeName = xmlTextReaderConstLocalName(reader);
-			if (!strcmp(nodeName, PROPFIND_RESOURCE_TYPE)) {
-				properties->resourceType = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CREATION_DATE)) {
-				properties->creationDate = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CONTENT_LENGTH)) {
-				properties->contentLength = 1;
-			} else if (!strcmp(nodeName, PROPFIND_LAST_MODIFIED)) {
-				properties->lastModified = 1;
-			} else if (!strcmp(nodeName, PROPFIND_DISPLAY_NAME)) {
-				properties->displayName = 1;
-			} else if (!strcmp(nodeName, PROPFIND_CONTENT_TYPE)) {
-				properties->contentType = 1;
-			} else if (!strcmp(nodeName, PROPFIND_AVAILABLE_BYTES)) {
-				properties->availableBytes = 1;
-			} else if (!strcmp(nodeName, PROPFIND_USED_BYTES)) {
-				properties->usedBytes = 1;
-			} else if (!strcmp(nodeName, PROPFIND_ETAG)) {
-				properties->etag = 1;
-			}
-		} else if (!strcmp(xmlTextReaderConstNamespaceUri(reader), MICROSOFT_NAMESPACE)) {
-			const char * nodeName = xmlTextReaderConstLocalName(reader);
-			if (!strcmp(nodeName, PROPFIND_WINDOWS_ATTRIBUTES)) {
-				properties->windowsHidden = 1;
-			}
-		}
+	while (readResult && xmlTextReaderDepth(reader) > 0 && !elementMatches(reader, WEBDAV_NAMESPACE, "prop")
+			&& !elementMatches(reader, WEBDAV_NAMESPACE, "allprop")) {
 		readResult = stepOver(reader);
 	}
 
+	if (elementMatches(reader, WEBDAV_NAMESPACE, "allprop")) {
+		setAllProperties(properties);
+	} else if (elementMatches(reader, WEBDAV_NAMESPACE, "prop")) {
+		readPropElement(reader, properties);
+	}
+
 	readResult = 1;
 
 	// finish up
@@ -599,256 +855,1929 @@ static int parsePropFind(int fd, PropertySet * properties) {
 	return readResult;
 }
 
-static void writePropFindResponsePart(const char * fileName, const char * displayName,
-		PropertySet * properties, struct stat * fileStat, xmlTextWriterPtr writer) {
-
-	xmlTextWriterStartElementNS(writer, "d", "response", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "href", NULL);
-	xmlTextWriterWriteURL(writer, fileName);
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterStartElementNS(writer, "d", "propstat", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "prop", NULL);
-
+typedef enum PropFindProperty {
+	PROPERTY_ETAG,
+	PROPERTY_CREATION_DATE,
+	PROPERTY_LAST_MODIFIED,
+	PROPERTY_RESOURCE_TYPE,
+	PROPERTY_QUOTA,
+	PROPERTY_CONTENT_LENGTH,
+	PROPERTY_CONTENT_TYPE,
+	PROPERTY_WINDOWS_ATTRIBUTES,
+	PROPERTY_WINDOWS_MODIFIED_TIME,
+	PROPERTY_WINDOWS_ACCESS_TIME,
+	PROPERTY_UPLOADED_RANGES
+} PropFindProperty;
+
+#define PROPFIND_PLAN_SIZE 11
+
+// What writePropFindResponsePart() writes for each entry.  This is worked out once per request so that the
+// PropertySet isn't re-examined for every file in a large listing.
+typedef struct PropFindPlan {
+	unsigned int statMask;
+	char availableBytes;
+	char usedBytes;
+	size_t collectionCount;
+	PropFindProperty collection[PROPFIND_PLAN_SIZE];
+	size_t fileCount;
+	PropFindProperty file[PROPFIND_PLAN_SIZE];
+	// Dead properties are only read from the file system if they have been asked for
+	char allDeadProperties;
+	size_t deadPropertyCount;
+	char * const * deadProperties;
+} PropFindPlan;
+
+static void compilePropFindPlan(const PropertySet * properties, PropFindPlan * plan) {
+	memset(plan, 0, sizeof(*plan));
+	// Only the fields needed are asked for when children are stat'ed
+	plan->statMask = STATX_TYPE;
 	if (properties->etag) {
-		char buffer[200];
-		snprintf(buffer, sizeof(buffer), "%lld-%lld", (long long) fileStat->st_size,
-				(long long) fileStat->st_mtime);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_ETAG, buffer);
+		plan->statMask |= STATX_SIZE | STATX_MTIME | STATX_CTIME;
+		plan->collection[plan->collectionCount++] = PROPERTY_ETAG;
+		plan->file[plan->fileCount++] = PROPERTY_ETAG;
 	}
 	if (properties->creationDate) {
-		char buffer[100];
-		getWebDate(fileStat->st_ctime, buffer, 100);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_CREATION_DATE, buffer);
+		plan->statMask |= STATX_CTIME;
+		plan->collection[plan->collectionCount++] = PROPERTY_CREATION_DATE;
+		plan->file[plan->fileCount++] = PROPERTY_CREATION_DATE;
 	}
 	if (properties->lastModified) {
-		char buffer[100];
-		getWebDate(fileStat->st_ctime, buffer, 100);
-		xmlTextWriterWriteElementString(writer, "d", PROPFIND_LAST_MODIFIED, buffer);
+		plan->statMask |= STATX_MTIME;
+		plan->collection[plan->collectionCount++] = PROPERTY_LAST_MODIFIED;
+		plan->file[plan->fileCount++] = PROPERTY_LAST_MODIFIED;
 	}
 	if (properties->resourceType) {
-		xmlTextWriterStartElementNS(writer, "d", PROPFIND_RESOURCE_TYPE, NULL);
-		if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
-			xmlTextWriterStartElementNS(writer, "d", "collection", NULL);
-			xmlTextWriterEndElement(writer);
-		}
-		xmlTextWriterEndElement(writer);
+		plan->collection[plan->collectionCount++] = PROPERTY_RESOURCE_TYPE;
+		plan->file[plan->fileCount++] = PROPERTY_RESOURCE_TYPE;
+	}
+	if (properties->availableBytes || properties->usedBytes) {
+		plan->availableBytes = properties->availableBytes;
+		plan->usedBytes = properties->usedBytes;
+		plan->collection[plan->collectionCount++] = PROPERTY_QUOTA;
+	}
+	if (properties->contentLength) {
+		plan->statMask |= STATX_SIZE;
+		plan->file[plan->fileCount++] = PROPERTY_CONTENT_LENGTH;
+	}
+	if (properties->contentType) {
+		plan->file[plan->fileCount++] = PROPERTY_CONTENT_TYPE;
+	}
+	if (properties->windowsHidden) {
+		plan->collection[plan->collectionCount++] = PROPERTY_WINDOWS_ATTRIBUTES;
+		plan->file[plan->fileCount++] = PROPERTY_WINDOWS_ATTRIBUTES;
+	}
+	if (properties->windowsModifiedTime) {
+		plan->statMask |= STATX_MTIME;
+		plan->collection[plan->collectionCount++] = PROPERTY_WINDOWS_MODIFIED_TIME;
+		plan->file[plan->fileCount++] = PROPERTY_WINDOWS_MODIFIED_TIME;
+	}
+	if (properties->windowsAccessTime) {
+		plan->statMask |= STATX_ATIME;
+		plan->collection[plan->collectionCount++] = PROPERTY_WINDOWS_ACCESS_TIME;
+		plan->file[plan->fileCount++] = PROPERTY_WINDOWS_ACCESS_TIME;
+	}
+	if (properties->uploadedRanges) {
+		plan->collection[plan->collectionCount++] = PROPERTY_UPLOADED_RANGES;
+		plan->file[plan->fileCount++] = PROPERTY_UPLOADED_RANGES;
 	}
-	//if (properties->displayName) {
-	//	xmlTextWriterWriteElementString(writer, PROPFIND_DISPLAY_NAME, displayName);
-	//}
-	if ((fileStat->st_mode & S_IFMT) == S_IFDIR) {
-		struct statvfs fsStat;
-		if ((properties->availableBytes || properties->usedBytes) && statvfs(fileName, &fsStat) != -1) {
-			if (properties->availableBytes) {
-				char buffer[100];
-				unsigned long long size = fsStat.f_bavail * fsStat.f_bsize;
-				snprintf(buffer, sizeof(buffer), "%llu", size);
-				xmlTextWriterWriteElementString(writer, "d", PROPFIND_AVAILABLE_BYTES, buffer);
-				if (properties->usedBytes) {
-					size = (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize;
-					snprintf(buffer, sizeof(buffer), "%llu", size);
-					xmlTextWriterWriteElementString(writer, "d", PROPFIND_USED_BYTES, buffer);
+	plan->allDeadProperties = properties->allDeadProperties;
+	plan->deadPropertyCount = properties->deadPropertyCount;
+	plan->deadProperties = properties->deadProperties;
+}
+
+typedef struct DirectoryEntry {
+	const char * name;
+	unsigned char type;
+} DirectoryEntry;
+
+typedef struct DirectoryListing {
+	size_t count;
+	DirectoryEntry * entries;
+	size_t bufferCount;
+	char ** buffers;
+} DirectoryListing;
+
+#define DIRECTORY_BUFFER_SIZE 65536
+#define PROPFIND_STAT_WINDOW 1024
+#define PROPFIND_DEPTH_INFINITY -1
+
+// The most responses a Depth: infinity PROPFIND may produce (including the target itself)
+static size_t propFindMaxEntries = 100000;
+
+// Reads every entry (except . and ..) of the directory fd with getdents64().  The names point into the buffers
+// the kernel filled so nothing is copied.  Returns 0 on success or -1 with errno set.
+static int readDirectoryListing(int fd, DirectoryListing * listing) {
+	memset(listing, 0, sizeof(*listing));
+	for (;;) {
+		char * buffer = mallocSafe(DIRECTORY_BUFFER_SIZE);
+		ssize_t bytesRead = getdents64(fd, buffer, DIRECTORY_BUFFER_SIZE);
+		if (bytesRead <= 0) {
+			int e = errno;
+			freeSafe(buffer);
+			errno = e;
+			return bytesRead == 0 ? 0 : -1;
+		}
+		if (!(listing->bufferCount & 0xF)) {
+			listing->buffers = reallocSafe(listing->buffers, sizeof(*listing->buffers) * (listing->bufferCount + 0x10));
+		}
+		listing->buffers[listing->bufferCount++] = buffer;
+
+		for (ssize_t offset = 0; offset < bytesRead;) {
+			struct dirent64 * entry = (struct dirent64 *) (buffer + offset);
+			offset += entry->d_reclen;
+			if (IS_DIR_CHILD(entry->d_name)) {
+				if (!(listing->count & 0x3FF)) {
+					listing->entries = reallocSafe(listing->entries,
+							sizeof(*listing->entries) * (listing->count + 0x400));
 				}
+				listing->entries[listing->count].name = entry->d_name;
+				listing->entries[listing->count].type = entry->d_type;
+				listing->count++;
 			}
-			if (properties->usedBytes) {
-				char buffer[100];
-				unsigned long long size = (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize;
-				snprintf(buffer, sizeof(buffer), "%llu", size);
-				xmlTextWriterWriteElementString(writer, "d", PROPFIND_USED_BYTES, buffer);
-			}
-			// When listing directories we only list this FS space in the directory not its children.
-			// It's not technically standards compliant but is is not likely to cause a problem in practice.
-			properties->availableBytes = 0;
-			properties->usedBytes = 0;
 		}
-		if (properties->windowsHidden) {
-			xmlTextWriterWriteElementString(writer, "z", PROPFIND_WINDOWS_ATTRIBUTES,
-					displayName[0] == '.' ? "00000012" : "00000010");
+	}
+}
+
+static void freeDirectoryListing(DirectoryListing * listing) {
+	for (size_t i = 0; i < listing->bufferCount; i++) {
+		freeSafe(listing->buffers[i]);
+	}
+	freeSafe(listing->buffers);
+	freeSafe(listing->entries);
+}
+
+// Fetches the stat of count entries in the listing starting at first, only asking for the fields needed by mask.
+// stats[0] and errors[0] correspond to entry first.  When only the file type is needed it is taken from the
+// directory entry itself and the entry is not stat'ed at all.  Symbolic links are always stat'ed since PROPFIND
+// reports what they point to.  Cached attributes are fine locally but on a network file system they can be
+// stale for as long as the client likes, so there the server is asked every time.
+static void statDirectoryListing(int fd, DirectoryListing * listing, size_t first, size_t count, unsigned int mask,
+		struct stat * stats, int * errors) {
+	const char ** names = mallocSafe(sizeof(*names) * (count ? count : 1));
+	size_t * indexes = mallocSafe(sizeof(*indexes) * (count ? count : 1));
+	size_t statCount = 0;
+	for (size_t i = 0; i < count; i++) {
+		unsigned char type = listing->entries[first + i].type;
+		if (mask == STATX_TYPE && type != DT_UNKNOWN && type != DT_LNK) {
+			memset(&stats[i], 0, sizeof(stats[i]));
+			stats[i].st_mode = DTTOIF(type);
+			errors[i] = 0;
+		} else {
+			names[statCount] = listing->entries[first + i].name;
+			indexes[statCount] = i;
+			statCount++;
 		}
-	} else {
-		if (properties->contentLength) {
+	}
+
+	if (statCount) {
+		struct stat * batchStats = mallocSafe(sizeof(*batchStats) * statCount);
+		int * batchErrors = mallocSafe(sizeof(*batchErrors) * statCount);
+		statBatch(fd, names, statCount, batchStats, batchErrors,
+				isNetworkFileSystem(fd) ? AT_STATX_SYNC_AS_STAT : AT_STATX_DONT_SYNC, mask);
+		for (size_t i = 0; i < statCount; i++) {
+			stats[indexes[i]] = batchStats[i];
+			errors[indexes[i]] = batchErrors[i];
+		}
+		freeSafe(batchStats);
+		freeSafe(batchErrors);
+	}
+	freeSafe(names);
+	freeSafe(indexes);
+}
+
+static void writePropFindResponsePart(const char * fileName, const char * displayName, PropFindPlan * plan,
+		struct stat * fileStat, XmlStream * stream) {
+
+	xmlStreamWriteLiteral(stream, "<d:response><d:href>");
+	xmlStreamWriteURL(stream, fileName);
+	xmlStreamWriteLiteral(stream, "</d:href><d:propstat><d:prop>");
+
+	int isDir = (fileStat->st_mode & S_IFMT) == S_IFDIR;
+	const PropFindProperty * properties = isDir ? plan->collection : plan->file;
+	size_t propertyCount = isDir ? plan->collectionCount : plan->fileCount;
+	int uploadedRangesMissing = 0;
+	for (size_t i = 0; i < propertyCount; i++) {
+		switch (properties[i]) {
+		case PROPERTY_ETAG:
+			xmlStreamWriteLiteral(stream, "<d:" PROPFIND_ETAG ">");
+			if (isDir) {
+				// A directory's size says nothing about its contents.  Adding or removing a child changes its
+				// mtime and a rename into it may only change its ctime, so both are used to the nanosecond.
+				xmlStreamWriteInteger(stream, fileStat->st_mtim.tv_sec * 1000000000LL + fileStat->st_mtim.tv_nsec);
+				xmlStreamWriteLiteral(stream, "-");
+				xmlStreamWriteInteger(stream, fileStat->st_ctim.tv_sec * 1000000000LL + fileStat->st_ctim.tv_nsec);
+			} else {
+				// Clients can set the mtime with PROPPATCH so two uploads of the same size may share it.  The ctime
+				// can't be set and changes with every write.
+				xmlStreamWriteInteger(stream, fileStat->st_size);
+				xmlStreamWriteLiteral(stream, "-");
+				xmlStreamWriteInteger(stream, fileStat->st_mtime);
+				xmlStreamWriteLiteral(stream, "-");
+				xmlStreamWriteInteger(stream, fileStat->st_ctim.tv_sec * 1000000000LL + fileStat->st_ctim.tv_nsec);
+			}
+			xmlStreamWriteLiteral(stream, "</d:" PROPFIND_ETAG ">");
+			break;
+
+		case PROPERTY_CREATION_DATE: {
 			char buffer[100];
-			snprintf(buffer, sizeof(buffer), "%lld", (long long) fileStat->st_size);
-			xmlTextWriterWriteElementString(writer, "d", PROPFIND_CONTENT_LENGTH, buffer);
+			size_t size = getWebDate(fileStat->st_ctime, buffer, sizeof(buffer));
+			xmlStreamWriteLiteral(stream, "<d:" PROPFIND_CREATION_DATE ">");
+			xmlStreamWrite(stream, buffer, size);
+			xmlStreamWriteLiteral(stream, "</d:" PROPFIND_CREATION_DATE ">");
+			break;
 		}
-		if (properties->contentType) {
-			xmlTextWriterWriteElementString(writer, "d", PROPFIND_CONTENT_TYPE, findMimeType(fileName)->type);
+
+		case PROPERTY_LAST_MODIFIED: {
+			char buffer[100];
+			size_t size = getWebDate(fileStat->st_mtime, buffer, sizeof(buffer));
+			xmlStreamWriteLiteral(stream, "<d:" PROPFIND_LAST_MODIFIED ">");
+			xmlStreamWrite(stream, buffer, size);
+			xmlStreamWriteLiteral(stream, "</d:" PROPFIND_LAST_MODIFIED ">");
+			break;
 		}
-		if (properties->windowsHidden) {
-			xmlTextWriterWriteElementString(writer, "z", PROPFIND_WINDOWS_ATTRIBUTES,
-					displayName[0] == '.' ? "00000022" : "00000020");
+
+		case PROPERTY_RESOURCE_TYPE:
+			if (isDir) {
+				xmlStreamWriteLiteral(stream, "<d:" PROPFIND_RESOURCE_TYPE "><d:collection/></d:"
+						PROPFIND_RESOURCE_TYPE ">");
+			} else {
+				xmlStreamWriteLiteral(stream, "<d:" PROPFIND_RESOURCE_TYPE "/>");
+			}
+			break;
+
+		case PROPERTY_QUOTA: {
+			struct statvfs fsStat;
+			if ((plan->availableBytes || plan->usedBytes) && statvfs(fileName, &fsStat) != -1) {
+				if (plan->availableBytes) {
+					xmlStreamWriteLiteral(stream, "<d:" PROPFIND_AVAILABLE_BYTES ">");
+					xmlStreamWriteInteger(stream, fsStat.f_bavail * fsStat.f_bsize);
+					xmlStreamWriteLiteral(stream, "</d:" PROPFIND_AVAILABLE_BYTES ">");
+				}
+				if (plan->usedBytes) {
+					xmlStreamWriteLiteral(stream, "<d:" PROPFIND_USED_BYTES ">");
+					xmlStreamWriteInteger(stream, (fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_bsize);
+					xmlStreamWriteLiteral(stream, "</d:" PROPFIND_USED_BYTES ">");
+				}
+				// When listing directories we only list this FS space in the directory not its children.
+				// It's not technically standards compliant but is is not likely to cause a problem in practice.
+				plan->availableBytes = 0;
+				plan->usedBytes = 0;
+			}
+			break;
 		}
 
-	}
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterWriteElementString(writer, "d", "status", "HTTP/1.1 200 OK");
-	xmlTextWriterEndElement(writer);
-	xmlTextWriterEndElement(writer);
+		case PROPERTY_CONTENT_LENGTH:
+			xmlStreamWriteLiteral(stream, "<d:" PROPFIND_CONTENT_LENGTH ">");
+			xmlStreamWriteInteger(stream, fileStat->st_size);
+			xmlStreamWriteLiteral(stream, "</d:" PROPFIND_CONTENT_LENGTH ">");
+			break;
 
-}
+		case PROPERTY_CONTENT_TYPE:
+			xmlStreamWriteLiteral(stream, "<d:" PROPFIND_CONTENT_TYPE ">");
+			xmlStreamWriteText(stream, findMimeType(fileName)->type);
+			xmlStreamWriteLiteral(stream, "</d:" PROPFIND_CONTENT_TYPE ">");
+			break;
 
-static int respondToPropFind(const char * file, LockType lockProvided, PropertySet * properties, int depth) {
-	size_t fileNameSize = strlen(file);
-	size_t filePathSize = fileNameSize;
-	if (fileNameSize > MAX_VARABLY_DEFINED_ARRAY) {
-		stdLogError(0, "URI was too large to process %zd", fileNameSize);
-		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, "URI was too large to process", NULL, file);
-	}
+		case PROPERTY_WINDOWS_ATTRIBUTES:
+			xmlStreamWriteLiteral(stream, "<z:" PROPFIND_WINDOWS_ATTRIBUTES ">");
+			if (isDir) {
+				xmlStreamWriteLiteral(stream, "0000001");
+			} else {
+				xmlStreamWriteLiteral(stream, "0000002");
+			}
+			if (displayName[0] == '.') {
+				xmlStreamWriteLiteral(stream, "2");
+			} else {
+				xmlStreamWriteLiteral(stream, "0");
+			}
+			xmlStreamWriteLiteral(stream, "</z:" PROPFIND_WINDOWS_ATTRIBUTES ">");
+			break;
 
-	struct stat fileStat;
-	int fd = open(file, O_RDONLY);
-	if (fd == -1 || fstat(fd, &fileStat) == -1
-			|| (lockProvided == LOCK_TYPE_NONE && flock(fd, LOCK_TYPE_SHARED) == -1)) {
-		if (fd != -1) close(fd);
-		int e = errno;
-		switch (e) {
-		case EACCES:
-			stdLogError(e, "PROPFIND access denied %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
-		case EWOULDBLOCK:
-			stdLogError(e, "PROPFIND file locked %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), NULL, file);
-		case ENOENT:
-		default:
-			stdLogError(e, "PROPFIND not found %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+		case PROPERTY_WINDOWS_MODIFIED_TIME: {
+			char buffer[100];
+			size_t size = getWebDate(fileStat->st_mtime, buffer, sizeof(buffer));
+			xmlStreamWriteLiteral(stream, "<z:" PROPFIND_WINDOWS_MODIFIED_TIME ">");
+			xmlStreamWrite(stream, buffer, size);
+			xmlStreamWriteLiteral(stream, "</z:" PROPFIND_WINDOWS_MODIFIED_TIME ">");
+			break;
+		}
+
+		case PROPERTY_WINDOWS_ACCESS_TIME: {
+			char buffer[100];
+			size_t size = getWebDate(fileStat->st_atime, buffer, sizeof(buffer));
+			xmlStreamWriteLiteral(stream, "<z:" PROPFIND_WINDOWS_ACCESS_TIME ">");
+			xmlStreamWrite(stream, buffer, size);
+			xmlStreamWriteLiteral(stream, "</z:" PROPFIND_WINDOWS_ACCESS_TIME ">");
+			break;
+		}
+
+		case PROPERTY_UPLOADED_RANGES: {
+			// Only files written with ranged PUTs have any
+			static UploadedRange ranges[MAX_UPLOADED_RANGES];
+			ssize_t size = isDir ? -1 : getxattr(fileName, UPLOADED_RANGES_ATTRIBUTE, ranges, sizeof(ranges));
+			if (size < 0) {
+				uploadedRangesMissing = 1;
+				break;
+			}
+			xmlStreamWriteLiteral(stream, "<e:" PROPFIND_UPLOADED_RANGES " xmlns:e=\"" EXTENSIONS_NAMESPACE "\">");
+			for (size_t r = 0; r < size / sizeof(*ranges); r++) {
+				if (r) xmlStreamWriteLiteral(stream, ",");
+				xmlStreamWriteInteger(stream, ranges[r].first);
+				xmlStreamWriteLiteral(stream, "-");
+				xmlStreamWriteInteger(stream, ranges[r].last);
+			}
+			xmlStreamWriteLiteral(stream, "</e:" PROPFIND_UPLOADED_RANGES ">");
+			break;
+		}
 		}
 	}
 
-	char filePath[filePathSize + 2];
-	normalizeDirName(filePath, file, &filePathSize, (fileStat.st_mode & S_IFMT) == S_IFDIR);
+	char found[plan->deadPropertyCount + 1];
+	size_t missingCount = 0;
+	if (plan->allDeadProperties) {
+		writeAllDeadProperties(stream, fileName);
+	} else if (plan->deadPropertyCount) {
+		writeDeadProperties(stream, fileName, plan->deadProperties, plan->deadPropertyCount, found);
+		for (size_t i = 0; i < plan->deadPropertyCount; i++) {
+			if (!found[i]) missingCount++;
+		}
+	}
 
-	int pipeEnds[2];
-	if (pipe(pipeEnds)) {
-		close(fd);
-		stdLogError(errno, "Could not create pipe to write content");
-		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	xmlStreamWriteLiteral(stream, "</d:prop><d:status>HTTP/1.1 200 OK</d:status></d:propstat>");
+	if (missingCount || uploadedRangesMissing) {
+		xmlStreamWriteLiteral(stream, "<d:propstat><d:prop>");
+		if (uploadedRangesMissing) {
+			xmlStreamWriteLiteral(stream, "<e:" PROPFIND_UPLOADED_RANGES " xmlns:e=\"" EXTENSIONS_NAMESPACE "\"/>");
+		}
+		for (size_t i = 0; i < plan->deadPropertyCount; i++) {
+			if (!found[i]) writeDeadPropertyName(stream, plan->deadProperties[i]);
+		}
+		xmlStreamWriteLiteral(stream, "</d:prop><d:status>HTTP/1.1 404 Not Found</d:status></d:propstat>");
 	}
+	xmlStreamWriteLiteral(stream, "</d:response>");
+}
 
-	const char * displayName = &file[fileNameSize - 2];
-	while (displayName >= file && *displayName != '/') {
-		displayName--;
+static void reservePath(char ** path, size_t * capacity, size_t size) {
+	if (size > *capacity) {
+		*capacity = size + 256;
+		*path = reallocSafe(*path, *capacity);
 	}
-	displayName++;
+}
 
-	time_t fileTime;
-	time(&fileTime);
-	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
-	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
-	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
-			XML_MIME_TYPE.typeStringSize);
-	message.params[RAP_PARAM_RESPONSE_LOCATION] = makeMessageParam(filePath, filePathSize + 1);
-	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
-	if (messageResult <= 0) {
-		freeSafe(filePath);
-		close(pipeEnds[PIPE_WRITE]);
-		close(fd);
-		return messageResult;
+// Writes a response for every entry of listing.  *path must hold the collection's path (ending in /) in its first
+// pathSize bytes; it is extended with each child's name in turn.
+static void writePropFindChildren(int fd, DirectoryListing * listing, char ** path, size_t * pathCapacity,
+		size_t pathSize, PropFindPlan * plan, XmlStream * stream) {
+	// Children are stat'ed a window at a time (in parallel where possible) and written out in order before
+	// moving on to the next window.  This keeps memory bounded and gets the response moving on large
+	// directories.
+	struct stat childStats[PROPFIND_STAT_WINDOW];
+	int childErrors[PROPFIND_STAT_WINDOW];
+
+	for (size_t i = 0; i < listing->count; i++) {
+		size_t window = i % PROPFIND_STAT_WINDOW;
+		if (!window) {
+			size_t windowSize = listing->count - i;
+			if (windowSize > PROPFIND_STAT_WINDOW) windowSize = PROPFIND_STAT_WINDOW;
+			statDirectoryListing(fd, listing, i, windowSize, plan->statMask, childStats, childErrors);
+		}
+		if (!childErrors[window]) {
+			const char * childName = listing->entries[i].name;
+			size_t nameSize = strlen(childName);
+			reservePath(path, pathCapacity, pathSize + nameSize + 2);
+			memcpy(*path + pathSize, childName, nameSize + 1);
+			if ((childStats[window].st_mode & S_IFMT) == S_IFDIR) {
+				(*path)[pathSize + nameSize] = '/';
+				(*path)[pathSize + nameSize + 1] = '\0';
+			}
+			writePropFindResponsePart(*path, childName, plan, &childStats[window], stream);
+		}
 	}
+}
 
-	// We've set up the pipe and sent read end across so now write the result
-	xmlTextWriterPtr writer = xmlNewFdTextWriter(pipeEnds[PIPE_WRITE]);
-	DIR * dir;
-	xmlTextWriterStartDocument(writer, "1.0", "utf-8", NULL);
-	xmlTextWriterStartElementNS(writer, "d", "multistatus", WEBDAV_NAMESPACE);
-	xmlTextWriterWriteAttribute(writer, "xmlns:z", MICROSOFT_NAMESPACE);
-	writePropFindResponsePart(filePath, displayName, properties, &fileStat, writer);
-	if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && (dir = fdopendir(fd))) {
-		struct dirent * dp;
-		char * childFileName = mallocSafe(filePathSize + 257);
-		size_t maxSize = 255;
-		memcpy(childFileName, filePath, filePathSize);
-		while ((dp = readdir(dir)) != NULL) {
-			if (IS_DIR_CHILD(dp->d_name)) {
-				size_t nameSize = strlen(dp->d_name);
-				if (nameSize > maxSize) {
-					childFileName = reallocSafe(childFileName, filePathSize + nameSize + 2);
-					maxSize = nameSize;
+typedef struct PropFindLevel {
+	int fd;
+	DirectoryListing listing;
+	size_t next;
+	size_t pathSize;
+} PropFindLevel;
+
+// Walks every collection below the directory fd depth first, writing the children of each as it goes.  When
+// stream is NULL nothing is written and the entries are only counted.  The walk holds one open directory and one
+// listing per level of the tree, never the whole tree.  Symbolic links are reported but never followed.  The walk
+// stops once more than limit entries have been seen.  Returns the number of entries seen (excluding fd itself).
+static size_t walkPropFindTree(int fd, char ** path, size_t * pathCapacity, size_t pathSize,
+		PropFindPlan * plan, XmlStream * stream, size_t limit) {
+	size_t seen = 0;
+	size_t levelCount = 0;
+	PropFindLevel * levels = NULL;
+	int levelFd = fd;
+	size_t levelPathSize = pathSize;
+	for (;;) {
+		if (levelFd != -1) {
+			DirectoryListing listing;
+			if (readDirectoryListing(levelFd, &listing)) {
+				stdLogError(errno, "Could not read directory %s", *path);
+				if (levelFd != fd) close(levelFd);
+			} else {
+				seen += listing.count;
+				if (stream) {
+					writePropFindChildren(levelFd, &listing, path, pathCapacity, levelPathSize, plan, stream);
 				}
-				strcpy(childFileName + filePathSize, dp->d_name);
-				if (!stat(childFileName, &fileStat)) {
-					if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-						childFileName[filePathSize + nameSize] = '/';
-						childFileName[filePathSize + nameSize + 1] = '\0';
-					}
-					writePropFindResponsePart(childFileName, dp->d_name, properties, &fileStat, writer);
+				if (!(levelCount & 0xF)) {
+					levels = reallocSafe(levels, sizeof(*levels) * (levelCount + 0x10));
 				}
+				levels[levelCount].fd = levelFd;
+				levels[levelCount].listing = listing;
+				levels[levelCount].next = 0;
+				levels[levelCount].pathSize = levelPathSize;
+				levelCount++;
+				if (seen > limit) break;
 			}
+			levelFd = -1;
 		}
-		closedir(dir);
-		freeSafe(childFileName);
-	} else {
-		close(fd);
-	}
-	xmlTextWriterEndElement(writer);
-	xmlFreeTextWriter(writer);
-	return messageResult;
 
-}
+		if (!levelCount) break;
+		PropFindLevel * level = &levels[levelCount - 1];
+		while (level->next < level->listing.count && level->listing.entries[level->next].type != DT_DIR
+				&& level->listing.entries[level->next].type != DT_UNKNOWN) {
+			level->next++;
+		}
+		if (level->next == level->listing.count) {
+			freeDirectoryListing(&level->listing);
+			if (level->fd != fd) close(level->fd);
+			levelCount--;
+			continue;
+		}
 
-static ssize_t propfind(Message * requestMessage) {
-	if (requestMessage->paramCount != 3) {
-		stdLogError(0, "PROPFIND request did not provide correct buffers: %d buffer(s)",
-				requestMessage->paramCount);
-		close(requestMessage->fd);
-		return respond(RAP_RESPOND_INTERNAL_ERROR);
+		const char * name = level->listing.entries[level->next++].name;
+		size_t nameSize = strlen(name);
+		reservePath(path, pathCapacity, level->pathSize + nameSize + 2);
+		memcpy(*path + level->pathSize, name, nameSize);
+		levelPathSize = level->pathSize + nameSize + 1;
+		(*path)[levelPathSize - 1] = '/';
+		(*path)[levelPathSize] = '\0';
+		levelFd = openat(level->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (levelFd == -1 && errno != ENOTDIR && errno != ELOOP && errno != ENOENT) {
+			stdLogError(errno, "Could not open directory %s", *path);
+		}
 	}
 
-	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	char * depthString = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_DEPTH]);
-	LockProvisions lockProvisions = messageParamTo(LockProvisions,
-			requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
-	if (!depthString) depthString = "1";
+	while (levelCount) {
+		levelCount--;
+		freeDirectoryListing(&levels[levelCount].listing);
+		if (levels[levelCount].fd != fd) close(levels[levelCount].fd);
+	}
+	freeSafe(levels);
+	return seen;
+}
 
+////////////////////
+// PROPFIND Cache //
+////////////////////
+
+// Sync clients repeat the same depth 1 PROPFIND on unchanged directories every few seconds.  The rendered response
+// is kept in memory and thrown away as soon as inotify reports a change to the directory or any of its child
+// directories.  The cache is per rap and therefore per user.  Requests for quota properties are never cached since
+// they change with any write to the file system.  Nor is anything on a network file system since inotify only sees
+// the changes made through this machine.
+
+#define PROPFIND_CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define PROPFIND_CACHE_MAX_ENTRY_BYTES (4 * 1024 * 1024)
+// Depth 1 responses for larger directories are streamed rather than built in memory
+#define PROPFIND_MEMORY_MAX_ENTRIES 10000
+#define PROPFIND_ETAG_SIZE 24
+#define PROPFIND_CACHE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB \
+		| IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct PropFindCacheEntry {
+	struct PropFindCacheEntry * next;
+	struct PropFindCacheEntry * prev;
+	char * path;
+	// The watches follow the inode rather than the path so this catches an ancestor being renamed away
+	dev_t device;
+	ino_t inode;
 	PropertySet properties;
-	if (requestMessage->fd == -1) {
-		memset(&properties, 1, sizeof(properties));
-	} else {
-		int ret = respond(RAP_RESPOND_CONTINUE);
-		if (ret < 0) {
-			return ret;
-		}
-		if (!parsePropFind(requestMessage->fd, &properties)) {
-			return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
-		}
+	char etag[PROPFIND_ETAG_SIZE];
+	char * body;
+	size_t bodySize;
+	size_t watchCount;
+	int * watches;
+} PropFindCacheEntry;
+
+typedef struct WatchReference {
+	int wd;
+	int references;
+} WatchReference;
+
+static int propFindCacheInotify = -1;
+// Most recently used first
+static PropFindCacheEntry * propFindCacheHead = NULL;
+static PropFindCacheEntry * propFindCacheTail = NULL;
+static size_t propFindCacheBytes = 0;
+static void * watchReferences = NULL;
+
+static void initializePropFindCache() {
+	propFindCacheInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (propFindCacheInotify == -1) {
+		stdLogError(errno, "Could not initialize inotify, PROPFIND responses will not be cached");
 	}
+}
 
-	return respondToPropFind(file, lockProvisions.source, &properties, (strcmp("0", depthString) ? 2 : 1));
+static int compareWatchReference(const void * a, const void * b) {
+	return ((const WatchReference *) a)->wd - ((const WatchReference *) b)->wd;
 }
 
-//////////////////
-// End PROPFIND //
-//////////////////
+static int compareWatch(const void * a, const void * b) {
+	return *((const int *) a) - *((const int *) b);
+}
+
+// Watches path for changes.  The watch is shared with any other cache entry watching the same directory.
+static int addPropFindWatch(int ** watches, size_t * watchCount, const char * path) {
+	int wd = inotify_add_watch(propFindCacheInotify, path, PROPFIND_CACHE_WATCH_MASK | IN_ONLYDIR);
+	if (wd == -1) return errno == ENOTDIR ? 0 : -1;
+	WatchReference key = { .wd = wd };
+	WatchReference ** found = tsearch(&key, &watchReferences, &compareWatchReference);
+	if (*found == &key) {
+		*found = mallocSafe(sizeof(WatchReference));
+		(*found)->wd = wd;
+		(*found)->references = 0;
+	}
+	(*found)->references++;
+	if (!(*watchCount & 0x3F)) {
+		*watches = reallocSafe(*watches, sizeof(**watches) * (*watchCount + 0x40));
+	}
+	(*watches)[(*watchCount)++] = wd;
+	return 0;
+}
+
+static void releasePropFindWatches(int * watches, size_t watchCount) {
+	for (size_t i = 0; i < watchCount; i++) {
+		WatchReference key = { .wd = watches[i] };
+		WatchReference ** found = tfind(&key, &watchReferences, &compareWatchReference);
+		if (found && !--(*found)->references) {
+			WatchReference * reference = *found;
+			tdelete(&key, &watchReferences, &compareWatchReference);
+			inotify_rm_watch(propFindCacheInotify, reference->wd);
+			freeSafe(reference);
+		}
+	}
+	freeSafe(watches);
+}
+
+static void removePropFindCacheEntry(PropFindCacheEntry * entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else propFindCacheHead = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else propFindCacheTail = entry->prev;
+	propFindCacheBytes -= entry->bodySize;
+	releasePropFindWatches(entry->watches, entry->watchCount);
+	freeSafe(entry->path);
+	freeSafe(entry->body);
+	freeSafe(entry);
+}
+
+// The same inotify events feed the sync-collection journal (see REPORT below)
+static void recordSyncChange(const struct inotify_event * event);
+
+// Reads every pending inotify event and drops the cache entries they affect.  Returns true if any of the events
+// affect the given watches which belong to a response that is still being built.
+static int processPropFindCacheEvents(const int * building, size_t buildingCount) {
+	int buildingStale = 0;
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t bytesRead;
+	while ((bytesRead = read(propFindCacheInotify, buffer, sizeof(buffer))) > 0) {
+		for (char * ptr = buffer; ptr < buffer + bytesRead;) {
+			const struct inotify_event * event = (const struct inotify_event *) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+			recordSyncChange(event);
+			for (size_t i = 0; i < buildingCount && !buildingStale; i++) {
+				buildingStale = (event->mask & IN_Q_OVERFLOW) || building[i] == event->wd;
+			}
+			PropFindCacheEntry * entry = propFindCacheHead;
+			while (entry) {
+				PropFindCacheEntry * next = entry->next;
+				if ((event->mask & IN_Q_OVERFLOW)
+						|| bsearch(&event->wd, entry->watches, entry->watchCount, sizeof(int), &compareWatch)) {
+					removePropFindCacheEntry(entry);
+				}
+				entry = next;
+			}
+		}
+	}
+	return buildingStale;
+}
+
+static int propFindCacheable(const PropertySet * properties, int depth, int fd, const struct stat * fileStat) {
+	return propFindCacheInotify != -1 && depth == 2 && (fileStat->st_mode & S_IFMT) == S_IFDIR
+			&& !properties->availableBytes && !properties->usedBytes && !properties->deadPropertyCount
+			&& !isNetworkFileSystem(fd);
+}
+
+// Only the flags are compared; cacheable requests never name dead properties
+static int samePropertySet(const PropertySet * a, const PropertySet * b) {
+	return !memcmp(a, b, offsetof(PropertySet, allDeadProperties) + 1);
+}
+
+static PropFindCacheEntry * findPropFindCacheEntry(const char * path, const PropertySet * properties,
+		const struct stat * fileStat) {
+	processPropFindCacheEvents(NULL, 0);
+	for (PropFindCacheEntry * entry = propFindCacheHead; entry; entry = entry->next) {
+		if (!strcmp(entry->path, path) && samePropertySet(&entry->properties, properties)) {
+			if (entry->device != fileStat->st_dev || entry->inode != fileStat->st_ino) {
+				removePropFindCacheEntry(entry);
+				return NULL;
+			}
+			if (entry->prev) {
+				// Move to the front
+				entry->prev->next = entry->next;
+				if (entry->next) entry->next->prev = entry->prev;
+				else propFindCacheTail = entry->prev;
+				entry->prev = NULL;
+				entry->next = propFindCacheHead;
+				propFindCacheHead->prev = entry;
+				propFindCacheHead = entry;
+			}
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Takes ownership of body and watches
+static void addPropFindCacheEntry(const char * path, const struct stat * fileStat, const PropertySet * properties,
+		const char * etag, char * body, size_t bodySize, int * watches, size_t watchCount) {
+	// Anything changed while the response was being built makes it stale before it's even stored
+	if (processPropFindCacheEvents(watches, watchCount)) {
+		releasePropFindWatches(watches, watchCount);
+		freeSafe(body);
+		return;
+	}
+
+	while (propFindCacheTail && propFindCacheBytes + bodySize > PROPFIND_CACHE_MAX_BYTES) {
+		removePropFindCacheEntry(propFindCacheTail);
+	}
+	PropFindCacheEntry * entry = mallocSafe(sizeof(*entry));
+	entry->path = copyString(path);
+	entry->device = fileStat->st_dev;
+	entry->inode = fileStat->st_ino;
+	entry->properties = *properties;
+	entry->properties.deadProperties = NULL;
+	strcpy(entry->etag, etag);
+	entry->body = body;
+	entry->bodySize = bodySize;
+	qsort(watches, watchCount, sizeof(*watches), &compareWatch);
+	entry->watches = watches;
+	entry->watchCount = watchCount;
+	entry->prev = NULL;
+	entry->next = propFindCacheHead;
+	if (propFindCacheHead) propFindCacheHead->prev = entry;
+	else propFindCacheTail = entry;
+	propFindCacheHead = entry;
+	propFindCacheBytes += bodySize;
+}
+
+////////////////////////
+// End PROPFIND Cache //
+////////////////////////
+
+// Writes the whole multistatus document.  children is the listing of fd for depth 1 (NULL for depth 0); for depth
+// infinity the tree is walked as it's written.
+static void writePropFindBody(XmlStream * stream, int fd, const char * filePath, size_t filePathSize,
+		const char * displayName, PropertySet * properties, struct stat * fileStat, int depth,
+		DirectoryListing * children) {
+	PropFindPlan plan;
+	compilePropFindPlan(properties, &plan);
+	xmlStreamWriteLiteral(stream, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<d:multistatus xmlns:d=\""
+			WEBDAV_NAMESPACE "\" xmlns:z=\"" MICROSOFT_NAMESPACE "\">");
+	writePropFindResponsePart(filePath, displayName, &plan, fileStat, stream);
+	if (depth == PROPFIND_DEPTH_INFINITY && (fileStat->st_mode & S_IFMT) == S_IFDIR) {
+		char * childPath = mallocSafe(filePathSize + 257);
+		size_t childPathCapacity = filePathSize + 257;
+		memcpy(childPath, filePath, filePathSize + 1);
+		size_t written = walkPropFindTree(fd, &childPath, &childPathCapacity, filePathSize, &plan, stream,
+				propFindMaxEntries - 1);
+		if (written > propFindMaxEntries - 1) {
+			// The 207 is already on its way so the only way left to say the listing is incomplete (RFC 4918 16)
+			stdLogError(0, "PROPFIND Depth: infinity grew beyond %zu entries while being written %s %s",
+					propFindMaxEntries, authenticatedUser, filePath);
+			xmlStreamWriteLiteral(stream, "<d:response><d:href>");
+			xmlStreamWriteURL(stream, filePath);
+			xmlStreamWriteLiteral(stream, "</d:href><d:status>HTTP/1.1 507 Insufficient Storage</d:status>"
+					"<d:error><d:number-of-matches-within-limits/></d:error></d:response>");
+		}
+		freeSafe(childPath);
+	} else if (children) {
+		char * childPath = mallocSafe(filePathSize + 257);
+		size_t childPathCapacity = filePathSize + 257;
+		memcpy(childPath, filePath, filePathSize);
+		writePropFindChildren(fd, children, &childPath, &childPathCapacity, filePathSize, &plan, stream);
+		freeSafe(childPath);
+	}
+	xmlStreamWriteLiteral(stream, "</d:multistatus>\n");
+}
+
+// Sends a 207 and writes the response as it's generated.  Used where the response may be too large to hold in
+// memory so no ETag is sent.  Takes ownership of fd and children.
+static int streamPropFind(int fd, const char * filePath, size_t filePathSize, const char * displayName,
+		PropertySet * properties, struct stat * fileStat, int depth, DirectoryListing * children) {
+	int pipeEnds[2];
+	if (openResponsePipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		if (children) freeDirectoryListing(children);
+		close(fd);
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	time_t fileTime;
+	time(&fileTime);
+	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
+			XML_MIME_TYPE.typeStringSize);
+	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+	if (messageResult > 0) {
+		XmlStream * stream = xmlStreamNew(pipeEnds[PIPE_WRITE], NULL);
+		writePropFindBody(stream, fd, filePath, filePathSize, displayName, properties, fileStat, depth, children);
+		xmlStreamFree(stream);
+	} else {
+		close(pipeEnds[PIPE_WRITE]);
+	}
+	if (children) freeDirectoryListing(children);
+	close(fd);
+	return messageResult;
+}
+
+// Does the If-None-Match header value match etag?  Weak comparison is used as RFC 7232 requires.
+static int ifNoneMatchMatches(const char * ifNoneMatch, const char * etag) {
+	size_t etagSize = strlen(etag);
+	const char * ptr = ifNoneMatch;
+	while (*ptr) {
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+		if (*ptr == '*') return 1;
+		if (ptr[0] == 'W' && ptr[1] == '/') ptr += 2;
+		const char * end = ptr;
+		while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+		if (end - ptr == etagSize && !strncmp(ptr, etag, etagSize)) return 1;
+		ptr = end;
+	}
+	return 0;
+}
+
+// The ETag of a response body is a 64 bit FNV-1a hash of it.  The body includes every property reported for
+// every entry so any change to what the client would see changes the ETag.
+static void makeBodyETag(char * etag, const char * body, size_t bodySize) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < bodySize; i++) {
+		hash ^= (unsigned char) body[i];
+		hash *= 0x100000001b3ULL;
+	}
+	snprintf(etag, PROPFIND_ETAG_SIZE, "\"%016llx\"", (unsigned long long) hash);
+}
+
+// Sends a response held in memory, or just a 304 if the client already has it.
+static ssize_t sendPropFindResponse(const char * filePath, size_t filePathSize, const char * body, size_t bodySize,
+		const char * etag, const char * ifNoneMatch) {
+	time_t fileTime;
+	time(&fileTime);
+	Message message = { .mID = RAP_RESPOND_NOT_MODIFIED, .fd = -1, .paramCount = 4 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
+			XML_MIME_TYPE.typeStringSize);
+	message.params[RAP_PARAM_RESPONSE_LOCATION] = makeMessageParam(filePath, filePathSize + 1);
+	message.params[RAP_PARAM_RESPONSE_ETAG] = stringToMessageParam(etag);
+	if (ifNoneMatch && ifNoneMatchMatches(ifNoneMatch, etag)) {
+		return sendMessage(RAP_CONTROL_SOCKET, &message);
+	}
+
+	int pipeEnds[2];
+	if (openResponsePipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+	message.mID = RAP_RESPOND_MULTISTATUS;
+	message.fd = pipeEnds[PIPE_READ];
+	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+	if (messageResult > 0) {
+		XmlStream * stream = xmlStreamNew(pipeEnds[PIPE_WRITE], NULL);
+		xmlStreamWrite(stream, body, bodySize);
+		xmlStreamFree(stream);
+	} else {
+		close(pipeEnds[PIPE_WRITE]);
+	}
+	return messageResult;
+}
+
+static int respondToPropFind(const char * file, LockType lockProvided, PropertySet * properties, int depth,
+		const char * ifNoneMatch) {
+	size_t fileNameSize = strlen(file);
+	size_t filePathSize = fileNameSize;
+	if (fileNameSize > MAX_VARABLY_DEFINED_ARRAY) {
+		stdLogError(0, "URI was too large to process %zd", fileNameSize);
+		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, "URI was too large to process", NULL, file);
+	}
+
+	struct stat fileStat;
+	int fd = open(file, O_RDONLY);
+	if (fd == -1 || fstat(fd, &fileStat) == -1
+			|| (lockProvided == LOCK_TYPE_NONE && flock(fd, LOCK_TYPE_SHARED) == -1)) {
+		if (fd != -1) close(fd);
+		int e = errno;
+		switch (e) {
+		case EACCES:
+			stdLogError(e, "PROPFIND access denied %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		case EWOULDBLOCK:
+			stdLogError(e, "PROPFIND file locked %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), NULL, file);
+		case ENOENT:
+		default:
+			stdLogError(e, "PROPFIND not found %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+		}
+	}
+
+	char filePath[filePathSize + 2];
+	normalizeDirName(filePath, file, &filePathSize, (fileStat.st_mode & S_IFMT) == S_IFDIR);
+
+	if (depth == PROPFIND_DEPTH_INFINITY && (fileStat.st_mode & S_IFMT) == S_IFDIR) {
+		// The status has to be decided before anything is sent so count the tree first.  This only reads directory
+		// entries and stops as soon as the limit is passed.
+		char * childPath = mallocSafe(filePathSize + 257);
+		size_t childPathCapacity = filePathSize + 257;
+		memcpy(childPath, filePath, filePathSize + 1);
+		size_t entries = walkPropFindTree(fd, &childPath, &childPathCapacity, filePathSize, NULL, NULL,
+				propFindMaxEntries - 1);
+		freeSafe(childPath);
+		if (entries > propFindMaxEntries - 1 || lseek(fd, 0, SEEK_SET) == -1) {
+			close(fd);
+			stdLogError(0, "PROPFIND Depth: infinity refused, more than %zu entries %s %s", propFindMaxEntries,
+					authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Too many entries for Depth: infinity",
+					"propfind-finite-depth", file);
+		}
+	}
+
+	const char * displayName = &file[fileNameSize - 2];
+	while (displayName >= file && *displayName != '/') {
+		displayName--;
+	}
+	displayName++;
+
+	if (depth == PROPFIND_DEPTH_INFINITY && (fileStat.st_mode & S_IFMT) == S_IFDIR) {
+		return streamPropFind(fd, filePath, filePathSize, displayName, properties, &fileStat, depth, NULL);
+	}
+
+	// Depth 0 and 1 responses are put together in memory before anything is sent.  That gives them an ETag and
+	// means If-None-Match can be answered with a 304 without sending the body at all.  A 304 only comes straight
+	// from the cache where inotify can be trusted to have thrown out stale entries; anywhere else (eg: a network
+	// file system) the body is rebuilt from fresh attributes and its ETag compared every time.
+	int cacheable = propFindCacheable(properties, depth, fd, &fileStat);
+	int * watches = NULL;
+	size_t watchCount = 0;
+	if (cacheable) {
+		PropFindCacheEntry * cached = findPropFindCacheEntry(filePath, properties, &fileStat);
+		if (cached) {
+			close(fd);
+			return sendPropFindResponse(filePath, filePathSize, cached->body, cached->bodySize, cached->etag,
+					ifNoneMatch);
+		}
+		// The watch must be in place before anything is read so that any change after this point is noticed
+		if (addPropFindWatch(&watches, &watchCount, filePath) || fstat(fd, &fileStat)) {
+			cacheable = 0;
+		}
+	}
+
+	DirectoryListing listing;
+	DirectoryListing * children = NULL;
+	if (depth > 1 && (fileStat.st_mode & S_IFMT) == S_IFDIR && readDirectoryListing(fd, &listing) == 0) {
+		children = &listing;
+		if (listing.count > PROPFIND_MEMORY_MAX_ENTRIES) {
+			// Too big to hold in memory so this one goes out as it's generated (without an ETag)
+			if (watches) releasePropFindWatches(watches, watchCount);
+			return streamPropFind(fd, filePath, filePathSize, displayName, properties, &fileStat, depth, children);
+		}
+		char * childPath = mallocSafe(filePathSize + 257);
+		size_t childPathCapacity = filePathSize + 257;
+		memcpy(childPath, filePath, filePathSize);
+		for (size_t i = 0; cacheable && i < listing.count; i++) {
+			// A child directory's own properties change when its contents change, which the parent's watch
+			// doesn't see.
+			unsigned char type = listing.entries[i].type;
+			if (type == DT_DIR || type == DT_UNKNOWN || type == DT_LNK) {
+				const char * childName = listing.entries[i].name;
+				size_t nameSize = strlen(childName);
+				reservePath(&childPath, &childPathCapacity, filePathSize + nameSize + 2);
+				memcpy(childPath + filePathSize, childName, nameSize + 1);
+				if (addPropFindWatch(&watches, &watchCount, childPath)) {
+					cacheable = 0;
+				}
+			}
+		}
+		freeSafe(childPath);
+	}
+
+	XmlWriterCopy body = { .data = NULL, .size = 0, .maxSize = SIZE_MAX, .overflowed = 0 };
+	XmlStream * stream = xmlStreamNew(-1, &body);
+	writePropFindBody(stream, fd, filePath, filePathSize, displayName, properties, &fileStat, depth, children);
+	xmlStreamFree(stream);
+	if (children) freeDirectoryListing(children);
+	close(fd);
+
+	char etag[PROPFIND_ETAG_SIZE];
+	makeBodyETag(etag, body.data, body.size);
+	ssize_t messageResult = sendPropFindResponse(filePath, filePathSize, body.data, body.size, etag, ifNoneMatch);
+	if (cacheable && body.size <= PROPFIND_CACHE_MAX_ENTRY_BYTES) {
+		addPropFindCacheEntry(filePath, &fileStat, properties, etag, body.data, body.size, watches, watchCount);
+	} else {
+		freeSafe(body.data);
+		if (watches) releasePropFindWatches(watches, watchCount);
+	}
+	return messageResult;
+}
+
+static ssize_t propfind(Message * requestMessage) {
+	if (requestMessage->paramCount != 3 && requestMessage->paramCount != 4) {
+		stdLogError(0, "PROPFIND request did not provide correct buffers: %d buffer(s)",
+				requestMessage->paramCount);
+		close(requestMessage->fd);
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	char * depthString = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_DEPTH]);
+	LockProvisions lockProvisions = messageParamTo(LockProvisions,
+			requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+	if (!depthString) depthString = "1";
+
+	PropertySet properties;
+	if (requestMessage->fd == -1) {
+		setAllProperties(&properties);
+	} else {
+		int ret = respond(RAP_RESPOND_CONTINUE);
+		if (ret < 0) {
+			return ret;
+		}
+		if (!parsePropFind(requestMessage->fd, &properties)) {
+			return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+		}
+		if (properties.tooManyDeadProperties) {
+			freePropertySet(&properties);
+			return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Too many properties requested", NULL, file);
+		}
+	}
+
+	int depth;
+	if (!strcmp("0", depthString)) depth = 1;
+	else if (!strcmp("infinity", depthString)) depth = PROPFIND_DEPTH_INFINITY;
+	else depth = 2;
+	const char * ifNoneMatch = requestMessage->paramCount > RAP_PARAM_REQUEST_IF_NONE_MATCH ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_IF_NONE_MATCH]) : NULL;
+	ssize_t result = respondToPropFind(file, lockProvisions.source, &properties, depth, ifNoneMatch);
+	freePropertySet(&properties);
+	return result;
+}
+
+//////////////////
+// End PROPFIND //
+//////////////////
+
+//////////////////////////////
+// REPORT (sync-collection) //
+//////////////////////////////
+
+// RFC 6578 sync-collection.  Once a client has synced a collection it is watched with the same inotify instance as
+// the PROPFIND cache and every change to one of its members is written to a journal.  A sync token names a point in
+// the journal so the next sync only has to report the members changed since then.  The journal lives as long as
+// the rap, so tokens from an earlier rap (different epoch), or ones that have fallen off the end of the journal, are
+// refused with valid-sync-token and the client starts again with a full sync.  Only sync-level 1 is supported.
+
+#define SYNC_TOKEN_PREFIX EXTENSIONS_NAMESPACE "sync:"
+#define SYNC_JOURNAL_SIZE 4096
+#define SYNC_MAX_COLLECTIONS 64
+
+typedef struct SyncChange {
+	uint64_t seq;
+	int wd;
+	char * name;
+} SyncChange;
+
+typedef struct SyncCollection {
+	char * path;
+	// As with the PROPFIND cache the watches follow the inode, not the path
+	dev_t device;
+	ino_t inode;
+	uint64_t since;
+	int * watches;
+	size_t watchCount;
+} SyncCollection;
+
+static uint64_t syncEpoch;
+// The sequence number of the last change recorded.  Change seq is kept in syncJournal[seq % SYNC_JOURNAL_SIZE].
+static uint64_t syncSeq = 0;
+static SyncChange syncJournal[SYNC_JOURNAL_SIZE];
+static size_t syncCollectionCount = 0;
+static SyncCollection syncCollections[SYNC_MAX_COLLECTIONS];
+
+static void initializeSyncJournal() {
+	syncEpoch = ((uint64_t) time(NULL) << 16) ^ getpid();
+}
+
+static void removeSyncCollection(size_t index) {
+	releasePropFindWatches(syncCollections[index].watches, syncCollections[index].watchCount);
+	freeSafe(syncCollections[index].path);
+	syncCollectionCount--;
+	memmove(&syncCollections[index], &syncCollections[index + 1],
+			sizeof(*syncCollections) * (syncCollectionCount - index));
+}
+
+static void recordSyncChange(const struct inotify_event * event) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		// Changes have been lost so nothing can be trusted
+		while (syncCollectionCount) {
+			removeSyncCollection(syncCollectionCount - 1);
+		}
+		return;
+	}
+	for (size_t i = 0; i < syncCollectionCount; i++) {
+		if (syncCollections[i].watches[0] == event->wd) {
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				removeSyncCollection(i);
+			} else if (event->len) {
+				SyncChange * change = &syncJournal[++syncSeq % SYNC_JOURNAL_SIZE];
+				freeSafe(change->name);
+				change->seq = syncSeq;
+				change->wd = event->wd;
+				change->name = copyString(event->name);
+			}
+			return;
+		}
+	}
+}
+
+// Starts journaling changes to the collection at path if it isn't already.  Returns the collection or NULL if
+// it can't be watched.  A journal for whatever used to be at path (before an ancestor was renamed) is dropped.
+static SyncCollection * watchSyncCollection(const char * path, const struct stat * fileStat) {
+	for (size_t i = 0; i < syncCollectionCount; i++) {
+		if (!strcmp(syncCollections[i].path, path)) {
+			if (syncCollections[i].device == fileStat->st_dev && syncCollections[i].inode == fileStat->st_ino) {
+				return &syncCollections[i];
+			}
+			removeSyncCollection(i);
+			break;
+		}
+	}
+	if (propFindCacheInotify == -1) return NULL;
+	int * watches = NULL;
+	size_t watchCount = 0;
+	if (addPropFindWatch(&watches, &watchCount, path) || !watchCount) {
+		stdLogError(errno, "Could not watch %s for sync-collection", path);
+		if (watches) releasePropFindWatches(watches, watchCount);
+		return NULL;
+	}
+	// Anything already queued happened before the watch was added
+	processPropFindCacheEvents(NULL, 0);
+	if (syncCollectionCount == SYNC_MAX_COLLECTIONS) {
+		// Clients holding tokens for the oldest collection will have to start over
+		removeSyncCollection(0);
+	}
+	SyncCollection * collection = &syncCollections[syncCollectionCount++];
+	collection->path = copyString(path);
+	collection->device = fileStat->st_dev;
+	collection->inode = fileStat->st_ino;
+	collection->since = syncSeq;
+	collection->watches = watches;
+	collection->watchCount = watchCount;
+	return collection;
+}
+
+typedef struct SyncCollectionRequest {
+	PropertySet properties;
+	char * syncToken;
+	int infinite;
+} SyncCollectionRequest;
+
+// Returns 1 for a sync-collection report, 0 for a malformed body or -1 for any other report.
+static int parseSyncCollection(int fd, SyncCollectionRequest * request) {
+	memset(request, 0, sizeof(*request));
+	xmlTextReaderPtr reader = xmlReaderForFd(fd, NULL, NULL, XML_PARSE_NOENT);
+	if (!reader) {
+		stdLogError(0, "could not create xml reader");
+		close(fd);
+		return 0;
+	}
+	xmlReaderSuppressErrors(reader);
+
+	int result = 0;
+	int readResult = stepInto(reader);
+	if (readResult && xmlTextReaderDepth(reader) == 0) {
+		if (!elementMatches(reader, WEBDAV_NAMESPACE, "sync-collection")) {
+			result = -1;
+		} else {
+			result = 1;
+			readResult = stepInto(reader);
+			while (readResult && xmlTextReaderDepth(reader) == 1) {
+				if (elementMatches(reader, WEBDAV_NAMESPACE, "sync-token")) {
+					const char * token;
+					readResult = stepOverText(reader, &token);
+					if (token) {
+						request->syncToken = copyString(token);
+						xmlFree((char *) token);
+					}
+				} else if (elementMatches(reader, WEBDAV_NAMESPACE, "sync-level")) {
+					const char * level;
+					readResult = stepOverText(reader, &level);
+					if (level) {
+						request->infinite = !strcmp(level, "infinite");
+						xmlFree((char *) level);
+					}
+				} else if (elementMatches(reader, WEBDAV_NAMESPACE, "prop")) {
+					readResult = readPropElement(reader, &request->properties);
+				} else {
+					readResult = stepOver(reader);
+				}
+			}
+		}
+	}
+
+	while (readResult > 0) {
+		// consume the rest of the input
+		readResult = stepOver(reader);
+	}
+	xmlFreeTextReader(reader);
+	close(fd);
+	return result;
+}
+
+// Returns the sequence number in a token issued by this rap, or -1 if it isn't one.
+static int64_t parseSyncToken(const char * token) {
+	size_t prefixSize = sizeof(SYNC_TOKEN_PREFIX) - 1;
+	if (strncmp(token, SYNC_TOKEN_PREFIX, prefixSize)) return -1;
+	char * end;
+	uint64_t epoch = strtoull(token + prefixSize, &end, 16);
+	if (*end != '-' || epoch != syncEpoch) return -1;
+	const char * seqString = end + 1;
+	uint64_t seq = strtoull(seqString, &end, 10);
+	if (end == seqString || *end || seq > syncSeq) return -1;
+	return seq;
+}
+
+static int compareNames(const void * a, const void * b) {
+	return strcmp(a, b);
+}
+
+static void noFree(void * node) {
+}
+
+static ssize_t respondToSyncCollection(const char * file, SyncCollectionRequest * request) {
+	if (request->infinite) {
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Only sync-level 1 is supported",
+				"sync-traversal-supported", file);
+	}
+
+	size_t filePathSize = strlen(file);
+	if (filePathSize > MAX_VARABLY_DEFINED_ARRAY) {
+		stdLogError(0, "URI was too large to process %zd", filePathSize);
+		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, "URI was too large to process", NULL, file);
+	}
+	char filePath[filePathSize + 2];
+	normalizeDirName(filePath, file, &filePathSize, 1);
+
+	int fd = open(file, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		int e = errno;
+		stdLogError(e, "REPORT could not open collection %s %s", authenticatedUser, file);
+		return writeErrorResponse(e == ENOENT ? RAP_RESPOND_NOT_FOUND : RAP_RESPOND_ACCESS_DENIED, strerror(e),
+				NULL, file);
+	}
+
+	// Bring the journal up to date then make sure the collection is watched before the directory is read so that
+	// nothing is missed between reading it and issuing the token.  inotify never sees changes made by other
+	// machines to a network file system so collections there aren't journaled at all and every token is refused,
+	// sending the client back to a full sync each time.
+	SyncCollection * collection = NULL;
+	struct stat fileStat;
+	if (fstat(fd, &fileStat)) {
+		int e = errno;
+		close(fd);
+		stdLogError(e, "REPORT could not stat collection %s %s", authenticatedUser, file);
+		return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	}
+	if (!isNetworkFileSystem(fd)) {
+		processPropFindCacheEvents(NULL, 0);
+		collection = watchSyncCollection(filePath, &fileStat);
+		if (!collection) {
+			close(fd);
+			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, "Could not watch collection for changes", NULL,
+					file);
+		}
+	}
+
+	int64_t since = -1;
+	if (request->syncToken && request->syncToken[0]) {
+		since = parseSyncToken(request->syncToken);
+		if (!collection || since < (int64_t) collection->since || syncSeq - since > SYNC_JOURNAL_SIZE) {
+			close(fd);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Sync token is no longer valid",
+					"valid-sync-token", file);
+		}
+	}
+	uint64_t tokenSeq = syncSeq;
+
+	DirectoryListing listing;
+	size_t changedCount = 0;
+	const char ** changed = NULL;
+	if (since == -1) {
+		if (readDirectoryListing(fd, &listing)) {
+			int e = errno;
+			close(fd);
+			stdLogError(e, "REPORT could not read collection %s %s", authenticatedUser, file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		}
+	} else {
+		// Each member changed since the token is reported once however many times it changed
+		void * seen = NULL;
+		int wd = collection->watches[0];
+		for (uint64_t seq = since + 1; seq <= syncSeq; seq++) {
+			SyncChange * change = &syncJournal[seq % SYNC_JOURNAL_SIZE];
+			if (change->wd == wd) {
+				const char ** found = tsearch(change->name, &seen, &compareNames);
+				if (*found == change->name) {
+					if (!(changedCount & 0x3F)) {
+						changed = reallocSafe(changed, sizeof(*changed) * (changedCount + 0x40));
+					}
+					changed[changedCount++] = change->name;
+				}
+			}
+		}
+		tdestroy(seen, &noFree);
+	}
+
+	int pipeEnds[2];
+	if (openResponsePipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		if (since == -1) freeDirectoryListing(&listing);
+		freeSafe(changed);
+		close(fd);
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	time_t fileTime;
+	time(&fileTime);
+	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
+			XML_MIME_TYPE.typeStringSize);
+	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+	if (messageResult <= 0) {
+		close(pipeEnds[PIPE_WRITE]);
+	} else {
+		PropFindPlan plan;
+		compilePropFindPlan(&request->properties, &plan);
+		XmlStream * stream = xmlStreamNew(pipeEnds[PIPE_WRITE], NULL);
+		xmlStreamWriteLiteral(stream, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<d:multistatus xmlns:d=\""
+				WEBDAV_NAMESPACE "\" xmlns:z=\"" MICROSOFT_NAMESPACE "\">");
+		char * childPath = mallocSafe(filePathSize + 257);
+		size_t childPathCapacity = filePathSize + 257;
+		memcpy(childPath, filePath, filePathSize);
+		if (since == -1) {
+			writePropFindChildren(fd, &listing, &childPath, &childPathCapacity, filePathSize, &plan, stream);
+		} else {
+			for (size_t i = 0; i < changedCount; i++) {
+				size_t nameSize = strlen(changed[i]);
+				reservePath(&childPath, &childPathCapacity, filePathSize + nameSize + 2);
+				memcpy(childPath + filePathSize, changed[i], nameSize + 1);
+				struct stat childStat;
+				if (fstatat(fd, changed[i], &childStat, 0) == 0) {
+					if ((childStat.st_mode & S_IFMT) == S_IFDIR) {
+						childPath[filePathSize + nameSize] = '/';
+						childPath[filePathSize + nameSize + 1] = '\0';
+					}
+					writePropFindResponsePart(childPath, changed[i], &plan, &childStat, stream);
+				} else if (errno == ENOENT) {
+					xmlStreamWriteLiteral(stream, "<d:response><d:href>");
+					xmlStreamWriteURL(stream, childPath);
+					xmlStreamWriteLiteral(stream, "</d:href><d:status>HTTP/1.1 404 Not Found</d:status></d:response>");
+				}
+			}
+		}
+		freeSafe(childPath);
+		char token[sizeof(SYNC_TOKEN_PREFIX) + 50];
+		snprintf(token, sizeof(token), SYNC_TOKEN_PREFIX "%" PRIx64 "-%" PRIu64, syncEpoch, tokenSeq);
+		xmlStreamWriteLiteral(stream, "<d:sync-token>");
+		xmlStreamWriteText(stream, token);
+		xmlStreamWriteLiteral(stream, "</d:sync-token></d:multistatus>\n");
+		xmlStreamFree(stream);
+	}
+
+	if (since == -1) freeDirectoryListing(&listing);
+	freeSafe(changed);
+	close(fd);
+	return messageResult;
+}
+
+static ssize_t report(Message * requestMessage) {
+	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	if (requestMessage->fd == -1) {
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "REPORT needs a body", NULL, file);
+	}
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		close(requestMessage->fd);
+		return ret;
+	}
+
+	SyncCollectionRequest request;
+	switch (parseSyncCollection(requestMessage->fd, &request)) {
+	case 1:
+		ret = request.properties.tooManyDeadProperties ?
+				writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Too many properties requested", NULL, file) :
+				respondToSyncCollection(file, &request);
+		freePropertySet(&request.properties);
+		freeSafe(request.syncToken);
+		return ret;
+	case -1:
+		freePropertySet(&request.properties);
+		freeSafe(request.syncToken);
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, "Only sync-collection reports are supported",
+				"supported-report", file);
+	default:
+		freePropertySet(&request.properties);
+		freeSafe(request.syncToken);
+		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+	}
+}
+
+//////////////////////////////////
+// End REPORT (sync-collection) //
+//////////////////////////////////
 
 ///////////////
 // PROPPATCH //
 ///////////////
 
+// RFC 4918 defines this for properties that weren't changed because another one in the same request failed
+#define PROPPATCH_FAILED_DEPENDENCY 424
+
+typedef struct PropertyUpdate {
+	char * namespace;
+	char * localName;
+	// The attribute the property is stored in, NULL if it is not stored
+	char * name;
+	// The element to store, NULL to remove the property
+	char * value;
+	// For the file times that can be set: 0 for the access time or 1 for the modified time (as futimens() takes
+	// them), otherwise -1
+	int timeIndex;
+	time_t time;
+	int status;
+	// What was there before so that the update can be undone, oldValueSize is -1 if there was nothing
+	char * oldValue;
+	ssize_t oldValueSize;
+} PropertyUpdate;
+
+static void addPropertyUpdate(PropertyUpdate ** updates, size_t * updateCount, xmlTextReaderPtr reader, int set) {
+	const char * namespace = xmlTextReaderConstNamespaceUri(reader);
+	const char * localName = xmlTextReaderConstLocalName(reader);
+	if (!namespace) namespace = "";
+	if (!(*updateCount & 0xF)) {
+		*updates = reallocSafe(*updates, sizeof(**updates) * (*updateCount + 0x10));
+	}
+	PropertyUpdate * update = &(*updates)[(*updateCount)++];
+	memset(update, 0, sizeof(*update));
+	update->namespace = copyString(namespace);
+	update->localName = copyString(localName);
+	update->oldValueSize = -1;
+	update->status = RAP_RESPOND_OK;
+	update->timeIndex = -1;
+	if (!strcmp(namespace, WEBDAV_NAMESPACE) && !strcmp(localName, PROPFIND_LAST_MODIFIED)) {
+		update->timeIndex = 1;
+	} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(localName, PROPFIND_WINDOWS_MODIFIED_TIME)) {
+		update->timeIndex = 1;
+	} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(localName, PROPFIND_WINDOWS_ACCESS_TIME)) {
+		update->timeIndex = 0;
+	}
+
+	if (update->timeIndex != -1) {
+		// Clients set these after an upload and compare them on their next sync.  If they weren't kept the file
+		// would look changed and be transferred again.
+		char * value = set ? xmlTextReaderReadString(reader) : NULL;
+		if (!set) {
+			update->status = RAP_RESPOND_ACCESS_DENIED;
+		} else if (!value || !parseWebDate(value, &update->time)) {
+			update->status = RAP_RESPOND_CONFLICT;
+		}
+		if (value) xmlFree(value);
+	} else if (!strcmp(namespace, WEBDAV_NAMESPACE)) {
+		// Every other DAV: property is live and can't be changed
+		update->status = RAP_RESPOND_ACCESS_DENIED;
+	} else if (!strcmp(namespace, EXTENSIONS_NAMESPACE) && !strcmp(localName, PROPFIND_UPLOADED_RANGES)) {
+		update->status = RAP_RESPOND_ACCESS_DENIED;
+	} else if (!strcmp(namespace, MICROSOFT_NAMESPACE) && !strcmp(localName, PROPFIND_WINDOWS_ATTRIBUTES)) {
+		// Windows sets this after every upload.  The only attribute reported is hidden, which comes from the file
+		// name, so it is accepted and not stored.
+	} else {
+		update->name = deadPropertyName(namespace, localName);
+		if (!update->name) {
+			update->status = RAP_RESPOND_ACCESS_DENIED;
+		} else if (set) {
+			char * value = xmlTextReaderReadOuterXml(reader);
+			update->value = copyString(value ? value : "");
+			if (value) xmlFree(value);
+		}
+	}
+}
+
+static void freePropertyUpdates(PropertyUpdate * updates, size_t updateCount) {
+	for (size_t i = 0; i < updateCount; i++) {
+		freeSafe(updates[i].namespace);
+		freeSafe(updates[i].localName);
+		freeSafe(updates[i].name);
+		freeSafe(updates[i].value);
+		freeSafe(updates[i].oldValue);
+	}
+	freeSafe(updates);
+}
+
+// Reads the set and remove instructions of a propertyupdate document in order.  Returns 0 if the body is malformed.
+static int parsePropertyUpdate(int fd, PropertyUpdate ** updates, size_t * updateCount) {
+	*updates = NULL;
+	*updateCount = 0;
+	xmlTextReaderPtr reader = xmlReaderForFd(fd, NULL, NULL, XML_PARSE_NOENT);
+	if (!reader) {
+		stdLogError(0, "could not create xml reader");
+		close(fd);
+		return 0;
+	}
+	xmlReaderSuppressErrors(reader);
+
+	int result = 0;
+	int readResult = stepInto(reader);
+	if (readResult && elementMatches(reader, WEBDAV_NAMESPACE, "propertyupdate")) {
+		result = 1;
+		readResult = stepInto(reader);
+		while (readResult && xmlTextReaderDepth(reader) == 1) {
+			int set = elementMatches(reader, WEBDAV_NAMESPACE, "set");
+			if (!set && !elementMatches(reader, WEBDAV_NAMESPACE, "remove")) {
+				readResult = stepOver(reader);
+				continue;
+			}
+			readResult = stepInto(reader);
+			while (readResult && xmlTextReaderDepth(reader) == 2) {
+				if (!elementMatches(reader, WEBDAV_NAMESPACE, "prop")) {
+					readResult = stepOver(reader);
+					continue;
+				}
+				readResult = stepInto(reader);
+				while (readResult && xmlTextReaderDepth(reader) == 3) {
+					if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
+						addPropertyUpdate(updates, updateCount, reader, set);
+					}
+					readResult = stepOver(reader);
+				}
+			}
+		}
+	}
+
+	while (readResult > 0) {
+		// consume the rest of the input
+		readResult = stepOver(reader);
+	}
+	xmlFreeTextReader(reader);
+	close(fd);
+	if (!result) {
+		freePropertyUpdates(*updates, *updateCount);
+		*updates = NULL;
+		*updateCount = 0;
+	}
+	return result;
+}
+
+static int propertyUpdateErrorStatus(int e) {
+	switch (e) {
+	case ENOSPC:
+	case EDQUOT:
+	case E2BIG:
+	case ERANGE:
+		return RAP_RESPOND_INSUFFICIENT_STORAGE;
+	case ENOTSUP:
+	case EPERM:
+	case EACCES:
+		return RAP_RESPOND_ACCESS_DENIED;
+	default:
+		return RAP_RESPOND_INTERNAL_ERROR;
+	}
+}
+
+// Makes the changes in order.  PROPPATCH is all or nothing so if any one of them can't be made the ones already made
+// are put back the way they were and the rest are marked as failed dependencies.
+static void applyPropertyUpdates(int fd, const char * file, PropertyUpdate * updates, size_t updateCount) {
+	int failed = 0;
+	for (size_t i = 0; i < updateCount; i++) {
+		if (updates[i].status != RAP_RESPOND_OK) failed = 1;
+	}
+
+	// File times are gathered up and set together once every property has been stored
+	struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT } };
+	int timesSet = 0;
+	char * buffer = mallocSafe(DEAD_PROPERTY_BUFFER_SIZE);
+	// Everything before applied has been changed
+	size_t applied = 0;
+	while (!failed && applied < updateCount) {
+		PropertyUpdate * update = &updates[applied];
+		if (update->timeIndex != -1) {
+			times[update->timeIndex].tv_sec = update->time;
+			times[update->timeIndex].tv_nsec = 0;
+			timesSet = 1;
+		}
+		if (!update->name) {
+			applied++;
+			continue;
+		}
+		update->oldValueSize = fgetxattr(fd, update->name, buffer, DEAD_PROPERTY_BUFFER_SIZE);
+		int result;
+		if (update->oldValueSize == -1 && errno != ENODATA) {
+			result = -1;
+		} else {
+			if (update->oldValueSize != -1) {
+				update->oldValue = mallocSafe(update->oldValueSize ? update->oldValueSize : 1);
+				memcpy(update->oldValue, buffer, update->oldValueSize);
+			}
+			if (update->value) {
+				result = fsetxattr(fd, update->name, update->value, strlen(update->value), 0);
+			} else {
+				result = fremovexattr(fd, update->name);
+				if (result == -1 && errno == ENODATA) result = 0;
+			}
+		}
+		if (result == -1) {
+			int e = errno;
+			stdLogError(e, "PROPPATCH could not update %s on %s %s", update->name, authenticatedUser, file);
+			update->status = propertyUpdateErrorStatus(e);
+			failed = 1;
+		} else {
+			applied++;
+		}
+	}
+	freeSafe(buffer);
+
+	if (!failed && timesSet && futimens(fd, times) == -1) {
+		int e = errno;
+		stdLogError(e, "PROPPATCH could not set times on %s %s", authenticatedUser, file);
+		for (size_t i = 0; i < updateCount; i++) {
+			if (updates[i].timeIndex != -1) updates[i].status = propertyUpdateErrorStatus(e);
+		}
+		failed = 1;
+	}
+
+	if (failed) {
+		for (size_t i = applied; i-- > 0;) {
+			PropertyUpdate * update = &updates[i];
+			if (!update->name) continue;
+			int result = update->oldValue ?
+					fsetxattr(fd, update->name, update->oldValue, update->oldValueSize, 0) :
+					fremovexattr(fd, update->name);
+			if (result == -1 && errno != ENODATA) {
+				stdLogError(errno, "PROPPATCH could not restore %s on %s %s", update->name, authenticatedUser,
+						file);
+			}
+		}
+		for (size_t i = 0; i < updateCount; i++) {
+			if (updates[i].status == RAP_RESPOND_OK) updates[i].status = PROPPATCH_FAILED_DEPENDENCY;
+		}
+	}
+}
+
+static void writePropertyUpdateStatus(XmlStream * stream, PropertyUpdate * update) {
+	xmlStreamWriteLiteral(stream, "<d:propstat><d:prop>");
+	writePropertyName(stream, update->namespace, strlen(update->namespace), update->localName);
+	xmlStreamWriteLiteral(stream, "</d:prop>");
+	switch (update->status) {
+	case RAP_RESPOND_OK:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 200 OK</d:status>");
+		break;
+	case RAP_RESPOND_ACCESS_DENIED:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 403 Forbidden</d:status>");
+		if (!strcmp(update->namespace, WEBDAV_NAMESPACE)) {
+			xmlStreamWriteLiteral(stream, "<d:error><d:cannot-modify-protected-property/></d:error>");
+		}
+		break;
+	case RAP_RESPOND_CONFLICT:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 409 Conflict</d:status>");
+		break;
+	case PROPPATCH_FAILED_DEPENDENCY:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 424 Failed Dependency</d:status>");
+		break;
+	case RAP_RESPOND_INSUFFICIENT_STORAGE:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 507 Insufficient Storage</d:status>");
+		break;
+	default:
+		xmlStreamWriteLiteral(stream, "<d:status>HTTP/1.1 500 Internal Server Error</d:status>");
+		break;
+	}
+	xmlStreamWriteLiteral(stream, "</d:propstat>");
+}
+
+static ssize_t sendPropPatchResponse(const char * filePath, PropertyUpdate * updates, size_t updateCount) {
+	int pipeEnds[2];
+	if (openResponsePipe(pipeEnds)) {
+		stdLogError(errno, "Could not create pipe to write content");
+		return respond(RAP_RESPOND_INTERNAL_ERROR);
+	}
+
+	time_t fileTime;
+	time(&fileTime);
+	Message message = { .mID = RAP_RESPOND_MULTISTATUS, .fd = pipeEnds[PIPE_READ], .paramCount = 2 };
+	message.params[RAP_PARAM_RESPONSE_DATE] = toMessageParam(fileTime);
+	message.params[RAP_PARAM_RESPONSE_MIME] = makeMessageParam(XML_MIME_TYPE.type,
+			XML_MIME_TYPE.typeStringSize);
+	ssize_t messageResult = sendMessage(RAP_CONTROL_SOCKET, &message);
+	if (messageResult <= 0) {
+		close(pipeEnds[PIPE_WRITE]);
+		return messageResult;
+	}
+
+	XmlStream * stream = xmlStreamNew(pipeEnds[PIPE_WRITE], NULL);
+	xmlStreamWriteLiteral(stream, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<d:multistatus xmlns:d=\""
+			WEBDAV_NAMESPACE "\"><d:response><d:href>");
+	xmlStreamWriteURL(stream, filePath);
+	xmlStreamWriteLiteral(stream, "</d:href>");
+	for (size_t i = 0; i < updateCount; i++) {
+		writePropertyUpdateStatus(stream, &updates[i]);
+	}
+	xmlStreamWriteLiteral(stream, "</d:response></d:multistatus>\n");
+	xmlStreamFree(stream);
+	return messageResult;
+}
+
 static ssize_t proppatch(Message * requestMessage) {
-	if (requestMessage->fd != -1) {
-		respond(RAP_RESPOND_CONTINUE);
-		char buffer[BUFFER_SIZE];
-		ssize_t bytesRead;
-		while ((bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
-			//ssize_t __attribute__ ((unused)) ignored = write(STDERR_FILENO, buffer, bytesRead);
+	const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
+	LockProvisions lockProvisions = messageParamTo(LockProvisions,
+			requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+	if (requestMessage->fd == -1) {
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "PROPPATCH needs a body", NULL, file);
+	}
+
+	size_t filePathSize = strlen(file);
+	if (filePathSize > MAX_VARABLY_DEFINED_ARRAY) {
+		close(requestMessage->fd);
+		stdLogError(0, "URI was too large to process %zd", filePathSize);
+		return writeErrorResponse(RAP_RESPOND_URI_TOO_LARGE, "URI was too large to process", NULL, file);
+	}
+
+	struct stat fileStat;
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &fileStat) == -1) {
+		int e = errno;
+		if (fd != -1) close(fd);
+		close(requestMessage->fd);
+		stdLogError(e, "PROPPATCH could not open %s %s", authenticatedUser, file);
+		return writeErrorResponse(e == EACCES ? RAP_RESPOND_ACCESS_DENIED : RAP_RESPOND_NOT_FOUND, strerror(e),
+				NULL, file);
+	}
+	if (lockProvisions.source != LOCK_TYPE_EXCLUSIVE && flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+		int e = errno;
+		close(fd);
+		close(requestMessage->fd);
+		stdLogError(e, "Could not change properties of locked file %s", file);
+		return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+	}
+
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		close(fd);
+		close(requestMessage->fd);
+		return ret;
+	}
+
+	PropertyUpdate * updates;
+	size_t updateCount;
+	if (!parsePropertyUpdate(requestMessage->fd, &updates, &updateCount)) {
+		close(fd);
+		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+	}
+
+	applyPropertyUpdates(fd, file, updates, updateCount);
+	close(fd);
+
+	char filePath[filePathSize + 2];
+	normalizeDirName(filePath, file, &filePathSize, (fileStat.st_mode & S_IFMT) == S_IFDIR);
+	ret = sendPropPatchResponse(filePath, updates, updateCount);
+	freePropertyUpdates(updates, updateCount);
+	return ret;
+}
+
+///////////////////
+// End PROPPATCH //
+///////////////////
+
+////////////////
+// Durability //
+////////////////
+
+// How hard we try to make sure that changes have reached the disk before telling the client they are done.
+//  - none: leave it to the kernel (the default)
+//  - fdatasync: every file is synced as it is closed and every directory as it is changed
+//  - group-commit: writeback is started straight away but the syncs are gathered up and made together just before
+//    the request is acknowledged.  Each directory is only synced once per request and very large batches are
+//    flushed with a syncfs() of each file system they touched.
+typedef enum Durability {
+	DURABILITY_NONE, DURABILITY_FDATASYNC, DURABILITY_GROUP_COMMIT
+} Durability;
+
+#define MAX_PENDING_SYNCS 64
+#define MAX_PENDING_SYNC_DEVICES 16
+#define SLOW_SYNC_NANOSECONDS 1000000000LL
+
+static Durability durability = DURABILITY_NONE;
+static int pendingSyncFds[MAX_PENDING_SYNCS];
+static int pendingSyncFdCount = 0;
+static char * pendingSyncDirs[MAX_PENDING_SYNCS];
+static int pendingSyncDirCount = 0;
+static int pendingSyncOverflow = 0;
+static dev_t pendingSyncDevices[MAX_PENDING_SYNC_DEVICES];
+static int pendingSyncDeviceFds[MAX_PENDING_SYNC_DEVICES];
+static int pendingSyncDeviceCount = 0;
+static int pendingSyncDeviceOverflow = 0;
+
+static void initializeDurability(const char * durabilityString) {
+	if (!durabilityString || !strcmp(durabilityString, "none")) {
+		durability = DURABILITY_NONE;
+	} else if (!strcmp(durabilityString, "fdatasync")) {
+		durability = DURABILITY_FDATASYNC;
+	} else if (!strcmp(durabilityString, "group-commit")) {
+		durability = DURABILITY_GROUP_COMMIT;
+	} else {
+		stdLogError(0, "Unknown durability %s", durabilityString);
+	}
+}
+
+static int syncDir(const char * dirName) {
+	int fd = open(dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) return -1;
+	int result = fsync(fd);
+	int e = errno;
+	close(fd);
+	errno = e;
+	return result;
+}
+
+// Records the file system of fd (or dirName if fd is -1), keeping something open on it for syncfs() in case there
+// turn out to be too many syncs to make one by one.
+static int addPendingSyncDevice(int fd, const char * dirName) {
+	struct stat fileStat;
+	if ((fd != -1 ? fstat(fd, &fileStat) : stat(dirName, &fileStat)) == -1) return -1;
+	for (int i = 0; i < pendingSyncDeviceCount; i++) {
+		if (pendingSyncDevices[i] == fileStat.st_dev) return 0;
+	}
+	if (pendingSyncDeviceCount == MAX_PENDING_SYNC_DEVICES) {
+		pendingSyncDeviceOverflow = 1;
+		return 0;
+	}
+	int syncFd = fd != -1 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : open(dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (syncFd == -1) return -1;
+	pendingSyncDevices[pendingSyncDeviceCount] = fileStat.st_dev;
+	pendingSyncDeviceFds[pendingSyncDeviceCount++] = syncFd;
+	return 0;
+}
+
+// Syncs (or queues a sync of) the data written to fd.  The caller remains responsible for closing fd.
+static int syncFileData(int fd) {
+	switch (durability) {
+	case DURABILITY_FDATASYNC:
+		return fdatasync(fd);
+
+	case DURABILITY_GROUP_COMMIT:
+		sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+		if (addPendingSyncDevice(fd, NULL) == -1) return fdatasync(fd);
+		if (pendingSyncFdCount < MAX_PENDING_SYNCS) {
+			int syncFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+			if (syncFd == -1) return fdatasync(fd);
+			pendingSyncFds[pendingSyncFdCount++] = syncFd;
+		} else {
+			pendingSyncOverflow = 1;
+		}
+		return 0;
+
+	case DURABILITY_NONE:
+	default:
+		return 0;
+	}
+}
+
+// Syncs (or queues a sync of) the directory containing file, making the creation, removal or renaming of file
+// durable.
+static int syncParentDir(const char * file) {
+	if (durability == DURABILITY_NONE) return 0;
+
+	// A collection's path may end in '/' but its parent is still the directory above it
+	size_t fileSize = strlen(file);
+	while (fileSize > 1 && file[fileSize - 1] == '/') {
+		fileSize--;
+	}
+	const char * end = memrchr(file, '/', fileSize);
+	size_t dirNameSize = end ? end - file : 0;
+	char dirName[dirNameSize + 2];
+	if (dirNameSize) {
+		memcpy(dirName, file, dirNameSize);
+		dirName[dirNameSize] = '\0';
+	} else {
+		strcpy(dirName, end ? "/" : ".");
+	}
+
+	if (durability == DURABILITY_FDATASYNC) return syncDir(dirName);
+
+	for (int i = 0; i < pendingSyncDirCount; i++) {
+		if (!strcmp(pendingSyncDirs[i], dirName)) return 0;
+	}
+	if (addPendingSyncDevice(-1, dirName) == -1) return syncDir(dirName);
+	if (pendingSyncDirCount < MAX_PENDING_SYNCS) {
+		pendingSyncDirs[pendingSyncDirCount++] = copyString(dirName);
+	} else {
+		pendingSyncOverflow = 1;
+	}
+	return 0;
+}
+
+static void discardPendingSyncs() {
+	for (int i = 0; i < pendingSyncFdCount; i++) {
+		close(pendingSyncFds[i]);
+	}
+	for (int i = 0; i < pendingSyncDirCount; i++) {
+		freeSafe(pendingSyncDirs[i]);
+	}
+	for (int i = 0; i < pendingSyncDeviceCount; i++) {
+		close(pendingSyncDeviceFds[i]);
+	}
+	pendingSyncFdCount = 0;
+	pendingSyncDirCount = 0;
+	pendingSyncOverflow = 0;
+	pendingSyncDeviceCount = 0;
+	pendingSyncDeviceOverflow = 0;
+}
+
+// Completes every sync queued by group-commit.  Must be called before acknowledging a request which queued any.
+static int flushPendingSyncs() {
+	if (!pendingSyncFdCount && !pendingSyncDirCount) return 0;
+
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int result = 0;
+	int e = 0;
+	if (pendingSyncOverflow) {
+		// Too many to sync one by one so sync every file system that had anything queued on it (or, if even those
+		// were too many to keep track of, all of them).
+		if (pendingSyncDeviceOverflow) {
+			sync();
+		} else {
+			for (int i = 0; i < pendingSyncDeviceCount; i++) {
+				if (syncfs(pendingSyncDeviceFds[i]) == -1 && !result) {
+					result = -1;
+					e = errno;
+				}
+			}
+		}
+	} else {
+		// Data before directories so that no name becomes durable before its content.
+		for (int i = 0; i < pendingSyncFdCount; i++) {
+			if (fdatasync(pendingSyncFds[i]) == -1 && !result) {
+				result = -1;
+				e = errno;
+			}
+		}
+		for (int i = 0; i < pendingSyncDirCount; i++) {
+			if (syncDir(pendingSyncDirs[i]) == -1 && !result) {
+				result = -1;
+				e = errno;
+			}
 		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	long long elapsed = (finish.tv_sec - start.tv_sec) * 1000000000LL + (finish.tv_nsec - start.tv_nsec);
+	if (elapsed > SLOW_SYNC_NANOSECONDS) {
+		stdLog("Group commit of %d file(s) and %d dir(s) took %lld ms", pendingSyncFdCount, pendingSyncDirCount,
+				elapsed / 1000000);
+	}
 
-		//char c = '\n';
-		//ssize_t __attribute__ ((unused)) ignored = write(STDOUT_FILENO, &c, 1);
-		close(requestMessage->fd);
-		PropertySet p;
-		memset(&p, 1, sizeof(p));
-		const char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-		return respondToPropFind(file, LOCK_TYPE_SHARED, &p, 1);
+	discardPendingSyncs();
+	errno = e;
+	return result;
+}
 
-	} else {
-		return respond(RAP_RESPOND_BAD_CLIENT_REQUEST);
+static ssize_t respondToSyncError(int e, const char * file) {
+	stdLogError(e, "Could not sync %s", file);
+	switch (e) {
+	case ENOSPC:
+	case EDQUOT:
+		return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+	default:
+		return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
 	}
 }
 
-///////////////////
-// End PROPPATCH //
-///////////////////
+////////////////////
+// End Durability //
+////////////////////
 
 ///////////
 // MKCOL //
@@ -879,6 +2808,9 @@ static ssize_t mkcol(Message * requestMessage) {
 			return writeErrorResponse(RAP_RESPOND_CONFLICT, strerror(e), NULL, fileName);
 		}
 	}
+	if (syncParentDir(fileName) == -1 || flushPendingSyncs() == -1) {
+		return respondToSyncError(errno, fileName);
+	}
 	return respond(RAP_RESPOND_CREATED);
 }
 
@@ -902,6 +2834,7 @@ typedef struct FileCopyData {
 static ssize_t copyErrorCleanup(FileCopyData * files, const char * action, const char * source,
 		const char * target) {
 	int e = errno;
+	discardPendingSyncs();
 	while (files) {
 		if (files->type == S_IFDIR) rmdir(files->target);
 		else unlink(files->target);
@@ -931,11 +2864,13 @@ static ssize_t copyErrorCleanup(FileCopyData * files, const char * action, const
 // If the copy fails the item is popped of the head of the list
 // If the copy succeeds and is a file then the list is unchanged except that ->type will be set.
 // If the copy succeeds and is a directory then copied child members are added to the head.
-static int copyFileRecursive(FileCopyData ** copied) {
+// fileStat may be provided if the source has already been lstat'ed, otherwise it is NULL.
+static int copyFileRecursive(FileCopyData ** copied, struct stat * knownStat) {
 // We are given the file to copy at the head of the "copied" list.
 	FileCopyData * toCopy = *copied;
 	struct stat fileStat;
-	if (lstat(toCopy->source, &fileStat) == -1) goto error_exit;
+	if (knownStat) fileStat = *knownStat;
+	else if (lstat(toCopy->source, &fileStat) == -1) goto error_exit;
 	toCopy->type = fileStat.st_mode & S_IFMT;
 	int mode = fileStat.st_mode & 0777;
 
@@ -948,15 +2883,17 @@ static int copyFileRecursive(FileCopyData ** copied) {
 			close(oldFd);
 			goto error_exit;
 		}
-		char readBuffer[BUFFER_SIZE];
-		ssize_t bytesRead = 0;
-		ssize_t bytesWritten = 0;
-		while ((bytesRead == bytesWritten) && ((bytesRead = read(oldFd, readBuffer, BUFFER_SIZE)) > 0)) {
-			bytesWritten = write(newFd, readBuffer, bytesRead);
-		}
+		int result = copyFileData(oldFd, newFd);
+		if (result != -1) result = syncFileData(newFd);
 		close(oldFd);
 		close(newFd);
-		if (bytesRead != 0) return 0;
+		if (result == -1) {
+			int e = errno;
+			unlink(toCopy->target);
+			errno = e;
+			goto error_exit;
+		}
+		copyDeadProperties(toCopy->source, toCopy->target, -1);
 		chmod(toCopy->target, mode);
 		break;
 	}
@@ -967,10 +2904,26 @@ static int copyFileRecursive(FileCopyData ** copied) {
 		} else {
 			DIR * dir = opendir(toCopy->source);
 			if (!dir) return 0;
+
+			// Stat every child in one batch before recursing into them.
+			size_t childCount = 0;
+			char ** childNames = NULL;
 			for (struct dirent * entry = readdir(dir); entry; entry = readdir(dir)) {
 				if (!IS_DIR_CHILD(entry->d_name)) continue;
+				if (!(childCount & 0x7F)) {
+					childNames = reallocSafe(childNames, sizeof(*childNames) * (childCount + 0x80));
+				}
+				childNames[childCount++] = copyString(entry->d_name);
+			}
+			struct stat * childStats = mallocSafe(sizeof(*childStats) * (childCount ? childCount : 1));
+			int * childErrors = mallocSafe(sizeof(*childErrors) * (childCount ? childCount : 1));
+			statBatch(dirfd(dir), (const char * const *) childNames, childCount, childStats, childErrors,
+					AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS);
+			closedir(dir);
 
-				size_t childNameLength = strlen(entry->d_name);
+			int success = 1;
+			for (size_t i = 0; i < childCount && success; i++) {
+				size_t childNameLength = strlen(childNames[i]);
 				FileCopyData * childToCopy = mallocSafe(
 						sizeof(FileCopyData) + toCopy->sourceNameLength + childNameLength
 								+ toCopy->targetNameLength + childNameLength + 2);
@@ -980,7 +2933,7 @@ static int copyFileRecursive(FileCopyData ** copied) {
 				char * ptr = (char *) (childToCopy + 1);
 				memcpy(ptr, toCopy->source, toCopy->sourceNameLength);
 				ptr[toCopy->sourceNameLength - 1] = '/';
-				memcpy(ptr + toCopy->sourceNameLength, entry->d_name, childNameLength + 1);
+				memcpy(ptr + toCopy->sourceNameLength, childNames[i], childNameLength + 1);
 				childToCopy->source = ptr;
 				childToCopy->sourceNameLength = size;
 
@@ -988,19 +2941,24 @@ static int copyFileRecursive(FileCopyData ** copied) {
 				ptr += childToCopy->sourceNameLength;
 				memcpy(ptr, toCopy->target, toCopy->targetNameLength);
 				ptr[toCopy->targetNameLength - 1] = '/';
-				memcpy(ptr + toCopy->targetNameLength, entry->d_name, childNameLength + 1);
+				memcpy(ptr + toCopy->targetNameLength, childNames[i], childNameLength + 1);
 				childToCopy->target = ptr;
 				childToCopy->targetNameLength = size;
 
 				childToCopy->next = *copied;
 				*copied = childToCopy;
 
-				if (!copyFileRecursive(copied)) {
-					closedir(dir);
-					return 0;
-				}
+				success = copyFileRecursive(copied, childErrors[i] ? NULL : &childStats[i]);
 			}
-			closedir(dir);
+
+			for (size_t i = 0; i < childCount; i++) {
+				freeSafe(childNames[i]);
+			}
+			freeSafe(childNames);
+			freeSafe(childStats);
+			freeSafe(childErrors);
+			if (!success) return 0;
+			copyDeadProperties(toCopy->source, toCopy->target, -1);
 			chmod(toCopy->target, mode);
 			break;
 		}
@@ -1034,9 +2992,10 @@ static int copyFileRecursive(FileCopyData ** copied) {
 
 
 	lchown(toCopy->target, fileStat.st_uid, fileStat.st_gid);
+	if (syncParentDir(toCopy->target) == -1) goto error_exit;
 	return 1;
 
-	error_exit: *copied = toCopy;
+	error_exit: *copied = toCopy->next;
 	freeSafe(toCopy);
 	return 0;
 }
@@ -1060,7 +3019,7 @@ static ssize_t copyFile(Message * requestMessage) {
 	copied->sourceNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_FILE]);
 	copied->targetNameLength = messageParamSize(requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
 	copied->next = NULL;
-	if (copyFileRecursive(&copied)) {
+	if (copyFileRecursive(&copied, NULL) && flushPendingSyncs() != -1) {
 		while (copied) {
 			FileCopyData * next = copied->next;
 			freeSafe(copied);
@@ -1104,7 +3063,8 @@ static ssize_t moveFile(Message * requestMessage) {
 			copiedFiles->targetNameLength = messageParamSize(
 					requestMessage->params[RAP_PARAM_REQUEST_TARGET]);
 			copiedFiles->next = NULL;
-			if (!copyFileRecursive(&copiedFiles)) {
+			// The copy must be durable before the originals are removed
+			if (!copyFileRecursive(&copiedFiles, NULL) || flushPendingSyncs() == -1) {
 				return copyErrorCleanup(copiedFiles, "move", sourceFile, targetFile);
 			}
 			while (copiedFiles) {
@@ -1119,6 +3079,9 @@ static ssize_t moveFile(Message * requestMessage) {
 		}
 	}
 
+	if (syncParentDir(targetFile) == -1 || syncParentDir(sourceFile) == -1 || flushPendingSyncs() == -1) {
+		return respondToSyncError(errno, targetFile);
+	}
 	return respond(RAP_RESPOND_OK_NO_CONTENT);
 
 }
@@ -1131,44 +3094,69 @@ static ssize_t moveFile(Message * requestMessage) {
 // DELETE //
 ////////////
 
-static ssize_t deleteFileRecursive(int fd, const char * file) {
+// Removes everything inside the directory fd, closing fd.  Returns 0 on success or -1 with errno set.
+// Sub directories are emptied first, then all the entries of this directory are unlinked in one batch.
+static int deleteDirectoryContents(int fd) {
 	DIR * dir = fdopendir(fd);
+	if (!dir) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	size_t count = 0;
+	char ** names = NULL;
+	int * flags = NULL;
 	struct dirent * dp;
 	while ((dp = readdir(dir)) != NULL) {
 		if (IS_DIR_CHILD(dp->d_name)) {
-			int childFd = openat(fd, dp->d_name, O_RDONLY);
-			if (childFd == -1) goto respond_error;
-			struct stat fileStat;
-			fstat(childFd, &fileStat);
-			// TODO lock
-			if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-				deleteFileRecursive(childFd, file);
-			} else {
-				close(childFd);
+			if (!(count & 0x7F)) {
+				names = reallocSafe(names, sizeof(*names) * (count + 0x80));
+				flags = reallocSafe(flags, sizeof(*flags) * (count + 0x80));
 			}
-			if (!unlinkat(fd, dp->d_name, AT_REMOVEDIR)) goto respond_error;
+			int isDir = dp->d_type == DT_DIR;
+			if (dp->d_type == DT_UNKNOWN) {
+				struct stat fileStat;
+				isDir = !fstatat(fd, dp->d_name, &fileStat, AT_SYMLINK_NOFOLLOW)
+						&& (fileStat.st_mode & S_IFMT) == S_IFDIR;
+			}
+			names[count] = copyString(dp->d_name);
+			flags[count] = isDir ? AT_REMOVEDIR : 0;
+			count++;
 		}
 	}
-	closedir(dir);
 
-	return 0;
+	int error = 0;
+	for (size_t i = 0; i < count && !error; i++) {
+		if (flags[i] == AT_REMOVEDIR) {
+			int childFd = openat(fd, names[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (childFd == -1 || deleteDirectoryContents(childFd) == -1) error = errno;
+		}
+	}
 
-	respond_error: {
-		int e = errno;
-		closedir(dir);
-		stdLogError(e, "Could not delete file %s", file);
-		if (fd != -1) close(fd);
-		switch (e) {
-		case EACCES:
-		case EPERM:
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
-		case ENOTDIR:
-		case ENOENT:
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
-		default:
-			return writeErrorResponse(RAP_RESPOND_INTERNAL_ERROR, strerror(e), NULL, file);
+	if (!error && count) {
+		int * errors = mallocSafe(sizeof(*errors) * count);
+		if (unlinkBatch(fd, (const char * const *) names, flags, count, errors)) {
+			for (size_t i = 0; i < count && !error; i++) {
+				error = errors[i];
+			}
 		}
+		freeSafe(errors);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		freeSafe(names[i]);
+	}
+	freeSafe(names);
+	freeSafe(flags);
+	closedir(dir);
+
+	if (error) {
+		errno = error;
+		return -1;
 	}
+	return 0;
 }
 
 static ssize_t deleteFile(Message * requestMessage) {
@@ -1185,7 +3173,7 @@ static ssize_t deleteFile(Message * requestMessage) {
 	struct stat fileStat;
 	if (fstat(fd, &fileStat) == -1) goto respond_error;
 	if ((fileStat.st_mode & S_IFMT) == S_IFDIR) {
-		ssize_t result = deleteFileRecursive(fd, file);
+		int result = deleteDirectoryContents(fd);
 		fd = -1;
 		if (result != 0 || rmdir(file) == -1) goto respond_error;
 	} else {
@@ -1204,6 +3192,9 @@ static ssize_t deleteFile(Message * requestMessage) {
 		close(fd);
 	}
 
+	if (syncParentDir(file) == -1 || flushPendingSyncs() == -1) {
+		return respondToSyncError(errno, file);
+	}
 	return respond(RAP_RESPOND_OK_NO_CONTENT);
 
 	respond_error: {
@@ -1231,6 +3222,334 @@ static ssize_t deleteFile(Message * requestMessage) {
 // PUT //
 /////////
 
+// Moves everything from the upload pipe into the file.  splice() lets the kernel move the pages straight from the
+// pipe into the file without copying them through this process.  If offset is NULL the data is written at the
+// file's current position, otherwise at *offset which is advanced and nothing is written at or beyond limit (-1 for
+// no limit).  Returns 0 on success, 1 if there was more data than limit allows (the rest is not written) or -1 with
+// errno set.
+static int receiveFileData(int pipeFd, int fd, off_t * offset, off_t limit) {
+	ssize_t bytesMoved;
+	do {
+		size_t size = UPLOAD_PIPE_SIZE;
+		if (offset && limit != -1) {
+			if (*offset >= limit) {
+				char c;
+				ssize_t extra;
+				while ((extra = read(pipeFd, &c, 1)) == -1 && errno == EINTR)
+					;
+				return extra > 0 ? 1 : extra;
+			}
+			if (limit - *offset < size) size = limit - *offset;
+		}
+		bytesMoved = splice(pipeFd, NULL, fd, offset, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+	} while (bytesMoved > 0 || (bytesMoved == -1 && errno == EINTR));
+	if (bytesMoved == 0) return 0;
+	if (errno != EINVAL && errno != ENOSYS) return -1;
+
+	// Either end does not support splice (old style pipe or file system) so copy it ourselves.
+	char buffer[BUFFER_SIZE];
+	ssize_t bytesRead;
+	for (;;) {
+		size_t size = sizeof(buffer);
+		if (offset && limit != -1) {
+			if (*offset >= limit) size = 1;
+			else if (limit - *offset < size) size = limit - *offset;
+		}
+		bytesRead = read(pipeFd, buffer, size);
+		if (bytesRead <= 0) break;
+		if (offset && limit != -1 && *offset >= limit) return 1;
+		ssize_t bytesWritten = offset ? pwrite(fd, buffer, bytesRead, *offset) : write(fd, buffer, bytesRead);
+		if (bytesWritten < bytesRead) {
+			if (bytesWritten != -1) errno = ENOSPC;
+			return -1;
+		}
+		if (offset) *offset += bytesWritten;
+	}
+	return bytesRead == 0 ? 0 : -1;
+}
+
+static ssize_t respondToPutOpenError(int e, const char * file) {
+	switch (e) {
+	case EACCES:
+		stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
+		return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+	case ENOENT:
+	default:
+		stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
+		return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(e), NULL, file);
+	}
+}
+
+// Parses "bytes <start>-<end>/<total>".  *total is set to -1 if the total is given as "*".
+static int parseContentRange(const char * range, off_t * start, off_t * end, off_t * total) {
+	char * ptr;
+	if (strncmp(range, "bytes ", 6)) return 0;
+	range += 6;
+	*start = strtoll(range, &ptr, 10);
+	if (ptr == range || *ptr != '-') return 0;
+	range = ptr + 1;
+	*end = strtoll(range, &ptr, 10);
+	if (ptr == range || *ptr != '/') return 0;
+	range = ptr + 1;
+	if (!strcmp(range, "*")) {
+		*total = -1;
+	} else {
+		*total = strtoll(range, &ptr, 10);
+		if (ptr == range || *ptr != '\0') return 0;
+	}
+	return 1;
+}
+
+// Adds first-last to the ranges of fd uploaded so far, merging it with any it overlaps or touches, and drops
+// anything at or beyond total (unless -1).  Segments may arrive over several connections at once, each handled by
+// its own rap, so the update is made under an OFD lock.
+static int recordUploadedRange(int fd, off_t first, off_t last, off_t total) {
+	static UploadedRange ranges[MAX_UPLOADED_RANGES];
+	static UploadedRange merged[MAX_UPLOADED_RANGES + 1];
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+	if (fcntl(fd, F_OFD_SETLKW, &lock) == -1) return -1;
+
+	ssize_t size = fgetxattr(fd, UPLOADED_RANGES_ATTRIBUTE, ranges, sizeof(ranges));
+	size_t count = size > 0 ? size / sizeof(*ranges) : 0;
+	UploadedRange added = { .first = first, .last = last };
+	size_t mergedCount = 0;
+	int placed = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (ranges[i].last + 1 < added.first) {
+			merged[mergedCount++] = ranges[i];
+		} else if (ranges[i].first > added.last + 1) {
+			if (!placed) {
+				merged[mergedCount++] = added;
+				placed = 1;
+			}
+			merged[mergedCount++] = ranges[i];
+		} else {
+			if (ranges[i].first < added.first) added.first = ranges[i].first;
+			if (ranges[i].last > added.last) added.last = ranges[i].last;
+		}
+	}
+	if (!placed) merged[mergedCount++] = added;
+	if (total != -1) {
+		while (mergedCount && merged[mergedCount - 1].first >= total) {
+			mergedCount--;
+		}
+		if (mergedCount && merged[mergedCount - 1].last >= total) merged[mergedCount - 1].last = total - 1;
+	}
+
+	int result;
+	if (mergedCount > MAX_UPLOADED_RANGES) {
+		// Leaving the range out only means the client sends it again
+		errno = E2BIG;
+		result = -1;
+	} else {
+		result = fsetxattr(fd, UPLOADED_RANGES_ATTRIBUTE, merged, mergedCount * sizeof(*merged), 0);
+	}
+	int e = errno;
+	lock.l_type = F_UNLCK;
+	fcntl(fd, F_OFD_SETLK, &lock);
+	errno = e;
+	return result;
+}
+
+// PUT with a Content-Range writes just that segment of the file in place.  This lets a client resume a broken
+// upload or send disjoint segments over several connections.  Segments may be written concurrently by a client
+// holding an exclusive WebDAV lock on the file; without one each segment takes the flock in turn.  The file size is
+// only the end of the highest segment written so the segments that have arrived are recorded and reported in the
+// uploaded-ranges property.
+static ssize_t writeFileRange(Message * requestMessage, const char * file, LockProvisions locks,
+		const char * rangeString) {
+	off_t start, end, total;
+	if (!parseContentRange(rangeString, &start, &end, &total)) {
+		close(requestMessage->fd);
+		stdLogError(0, "Invalid Content-Range %s for %s", rangeString, file);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Invalid Content-Range", NULL, file);
+	}
+	if (start < 0 || end < start || (total != -1 && end >= total)) {
+		close(requestMessage->fd);
+		stdLogError(0, "Unsatisfiable Content-Range %s for %s", rangeString, file);
+		return writeErrorResponse(RAP_RESPOND_RANGE_NOT_SATISFIABLE, "Unsatisfiable Content-Range", NULL, file);
+	}
+	// A body that doesn't fit the range is refused before any of it is written so it can never spill over into a
+	// neighbouring segment
+	const char * lengthString = requestMessage->paramCount > RAP_PARAM_REQUEST_LENGTH ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_LENGTH]) : NULL;
+	if (lengthString && strtoll(lengthString, NULL, 10) != end - start + 1) {
+		close(requestMessage->fd);
+		stdLogError(0, "Content-Range %s does not match Content-Length %s for %s", rangeString, lengthString, file);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Content-Range does not match Content-Length",
+				NULL, file);
+	}
+
+	int fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, NEW_FILE_PERMISSIONS);
+	if (fd == -1) {
+		int e = errno;
+		close(requestMessage->fd);
+		return respondToPutOpenError(e, file);
+	}
+	if (locks.source != LOCK_TYPE_EXCLUSIVE && flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+		int e = errno;
+		close(fd);
+		close(requestMessage->fd);
+		stdLogError(e, "Could not write locked file %s", file);
+		return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+	}
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, start, end - start + 1) == -1
+			&& (errno == ENOSPC || errno == EDQUOT || errno == EFBIG)) {
+		int e = errno;
+		close(fd);
+		close(requestMessage->fd);
+		stdLogError(e, "Could not reserve %s %s", rangeString, file);
+		return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+	}
+
+	int ret = respond(RAP_RESPOND_CONTINUE);
+	if (ret < 0) {
+		close(fd);
+		close(requestMessage->fd);
+		return ret;
+	}
+
+	// Without a Content-Length (chunked) the range still caps what is written
+	off_t offset = start;
+	int received = receiveFileData(requestMessage->fd, fd, &offset, end + 1);
+	if (received == -1) {
+		stdLogError(errno, "Could wite data to file %s", file);
+		close(fd);
+		close(requestMessage->fd);
+		return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+	}
+	close(requestMessage->fd);
+
+	if (received || offset != end + 1) {
+		close(fd);
+		stdLogError(0, "Content-Range %s did not match the %s%lld bytes sent for %s", rangeString,
+				received ? "more than " : "", (long long) (offset - start), file);
+		return writeErrorResponse(RAP_RESPOND_BAD_CLIENT_REQUEST, "Content-Range does not match the data sent",
+				NULL, file);
+	}
+
+	// The file may previously have been longer than the new total
+	struct stat fileStat;
+	if (total != -1 && !fstat(fd, &fileStat) && fileStat.st_size > total) ftruncate(fd, total);
+	int result = syncFileData(fd);
+	if (result == -1 || syncParentDir(file) == -1 || flushPendingSyncs() == -1) {
+		int e = errno;
+		close(fd);
+		return respondToSyncError(e, file);
+	}
+	// Only recorded once the data is durable so the ranges never claim more than has really arrived
+	if (recordUploadedRange(fd, start, end, total) == -1) {
+		stdLogError(errno, "Could not record uploaded range %s for %s", rangeString, file);
+	}
+	close(fd);
+	return respond(RAP_RESPOND_OK_NO_CONTENT);
+}
+
+// Opens a new anonymous file in the same directory as file for the upload to be written into.  O_TMPFILE is used
+// where possible so that nothing is left behind if the rap dies, otherwise a hidden temporary file is created and
+// its name is returned in *tempName.
+static int openUploadFile(const char * file, char ** tempName) {
+	const char * baseName = strrchr(file, '/');
+	size_t dirNameSize = baseName ? baseName - file : 0;
+	baseName = baseName ? baseName + 1 : file;
+	char dirName[dirNameSize + 2];
+	if (dirNameSize) {
+		memcpy(dirName, file, dirNameSize);
+		dirName[dirNameSize] = '\0';
+	} else {
+		strcpy(dirName, file[0] == '/' ? "/" : ".");
+	}
+
+	*tempName = NULL;
+	// Linking an O_TMPFILE into the tree needs /proc which may be missing inside a chroot
+	if (!access("/proc/self/fd", X_OK)) {
+		int fd = open(dirName, O_TMPFILE | O_WRONLY | O_CLOEXEC, NEW_FILE_PERMISSIONS);
+		if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+			return fd;
+		}
+	}
+
+	size_t tempNameSize = strlen(dirName) + strlen(baseName) + sizeof("/.webdavd-XXXXXX") + 1;
+	*tempName = mallocSafe(tempNameSize);
+	snprintf(*tempName, tempNameSize, "%s/.%s.webdavd-XXXXXX", dirName, baseName);
+	int fd = mkostemp(*tempName, O_CLOEXEC);
+	if (fd == -1) {
+		int e = errno;
+		freeSafe(*tempName);
+		*tempName = NULL;
+		errno = e;
+		return -1;
+	}
+	mode_t mask = umask(0);
+	umask(mask);
+	fchmod(fd, NEW_FILE_PERMISSIONS & ~mask);
+	return fd;
+}
+
+static void discardUploadFile(int fd, char * tempName) {
+	close(fd);
+	if (tempName) {
+		unlink(tempName);
+		freeSafe(tempName);
+	}
+}
+
+// Moves a completed upload over the top of file.  Returns 0 on success or -1 with errno set.
+static int commitUploadFile(int fd, char * tempName, const char * file) {
+	if (!tempName) {
+		// An O_TMPFILE has no name yet.  linkat() refuses to replace an existing file so give it a hidden name
+		// (in the same form as openUploadFile()) then rename() that over the target.
+		char procPath[50];
+		snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", fd);
+		const char * baseName = strrchr(file, '/');
+		int dirNameSize = baseName ? baseName + 1 - file : 0;
+		baseName = baseName ? baseName + 1 : file;
+		size_t tempNameSize = strlen(file) + 50;
+		tempName = mallocSafe(tempNameSize);
+		static unsigned int uploadCounter = 0;
+		int result;
+		do {
+			snprintf(tempName, tempNameSize, "%.*s.%s.webdavd-%d-%u", dirNameSize, file, baseName, getpid(),
+					uploadCounter++);
+			result = linkat(AT_FDCWD, procPath, AT_FDCWD, tempName, AT_SYMLINK_FOLLOW);
+		} while (result == -1 && errno == EEXIST);
+		if (result == -1) {
+			int e = errno;
+			freeSafe(tempName);
+			close(fd);
+			errno = e;
+			return -1;
+		}
+	}
+
+	int result = rename(tempName, file);
+	int e = errno;
+	if (result == -1) unlink(tempName);
+	freeSafe(tempName);
+	close(fd);
+	errno = e;
+	return result;
+}
+
+// Returns 1 if nobody else holds a lock on the existing file.  If lockFd is not NULL the exclusive lock is kept and
+// its fd returned so that it may be held across the rename.
+static int checkUploadUnlocked(const char * file, int * lockFd) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (fd == -1) {
+		if (lockFd) *lockFd = -1;
+		return 1;
+	}
+	if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return 0;
+	}
+	if (lockFd) *lockFd = fd;
+	else close(fd);
+	return 1;
+}
+
 static ssize_t writeFile(Message * requestMessage) {
 	if (requestMessage->fd == -1) {
 		stdLogError(0, "PUT request sent without incoming data!");
@@ -1238,51 +3557,163 @@ static ssize_t writeFile(Message * requestMessage) {
 	}
 
 	char * file = messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_FILE]);
-	int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, NEW_FILE_PERMISSIONS);
+	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
+
+	const char * rangeString = requestMessage->paramCount > RAP_PARAM_REQUEST_RANGE ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_RANGE]) : NULL;
+	if (rangeString) {
+		return writeFileRange(requestMessage, file, locks, rangeString);
+	}
+
+	// Uploads are written to a separate file and moved over the target once complete.  This way readers never see
+	// or wait for a partial upload and a failed upload leaves the old file untouched.  The file is written in place
+	// where replacing it would change its identity: an exclusive WebDAV lock is held on it, it has other hard links,
+	// it belongs to someone else or it is reached through a symlink (which would otherwise be replaced itself).
+	struct stat fileStat;
+	int exists = !lstat(file, &fileStat);
+	int isLink = exists && (fileStat.st_mode & S_IFMT) == S_IFLNK;
+	if (isLink) exists = !stat(file, &fileStat);
+	int inPlace = locks.source == LOCK_TYPE_EXCLUSIVE || isLink
+			|| (exists && (fileStat.st_nlink > 1 || fileStat.st_uid != geteuid()));
+	char * tempName = NULL;
+	int fd = -1;
+	if (exists && (fileStat.st_mode & S_IFMT) == S_IFDIR) {
+		errno = EISDIR;
+	} else if (!inPlace) {
+		fd = openUploadFile(file, &tempName);
+		if (fd == -1 && exists && (errno == EACCES || errno == EPERM)) {
+			// We may write to the file but not the directory it lives in.
+			inPlace = 1;
+		} else if (fd != -1 && exists) {
+			// The replacement is a new file so carry over what belongs to the old one
+			fchmod(fd, fileStat.st_mode & 07777);
+			fchown(fd, -1, fileStat.st_gid);
+			copyDeadProperties(file, tempName, fd);
+		}
+	}
+	if (inPlace) {
+		fd = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, NEW_FILE_PERMISSIONS);
+	}
+
 	if (fd == -1) {
 		int e = errno;
-		switch (e) {
-		case EACCES:
-			stdLogError(e, "PUT access denied %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(errno), NULL, file);
-		case ENOENT:
-		default:
-			stdLogError(e, "PUT not found %s %s", authenticatedUser, file);
-			return writeErrorResponse(RAP_RESPOND_NOT_FOUND, strerror(errno), NULL, file);
-		}
+		close(requestMessage->fd);
+		return respondToPutOpenError(e, file);
 	}
+
 // Check if we have the apropriate lock on this file.
-	LockProvisions locks = messageParamTo(LockProvisions, requestMessage->params[RAP_PARAM_REQUEST_LOCK]);
 	if (locks.source != LOCK_TYPE_EXCLUSIVE) {
 		// We have no lock but we need one so acquire it now.
-		if (flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1) {
-			close(fd);
+		if (inPlace ? flock(fd, LOCK_TYPE_EXCLUSIVE | LOCK_NB) == -1 : !checkUploadUnlocked(file, NULL)) {
 			int e = errno;
-			const char * etxt = strerror(e);
+			discardUploadFile(fd, tempName);
+			close(requestMessage->fd);
 			stdLogError(e, "Could not write locked file %s", file);
-			return writeErrorResponse(RAP_RESPOND_LOCKED, etxt, "lock-token-submitted", file);
+			return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
 		}
 	}
+	// Reserve the space for a sized upload before the client starts sending it.  This keeps large files in one
+	// piece on disk and turns a full disk into a 507 before the 100-continue rather than after gigabytes.
+	// FALLOC_FL_KEEP_SIZE means readers of an in place upload never see the file padded with zeros.  An in place
+	// upload keeps the old contents until the reservation has been made and the client told to go ahead.
+	const char * lengthString = requestMessage->paramCount > RAP_PARAM_REQUEST_LENGTH ?
+			messageParamToString(&requestMessage->params[RAP_PARAM_REQUEST_LENGTH]) : NULL;
+	off_t contentLength = lengthString ? strtoll(lengthString, NULL, 10) : 0;
+	if (contentLength > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, contentLength) == -1) {
+		int e = errno;
+		if (e == ENOSPC || e == EDQUOT || e == EFBIG) {
+			if (!inPlace) discardUploadFile(fd, tempName);
+			else close(fd);
+			// Don't leave behind an empty file that the client never managed to create
+			if (inPlace && !exists && !isLink) unlink(file);
+			close(requestMessage->fd);
+			stdLogError(e, "Could not reserve %lld bytes for %s", (long long) contentLength, file);
+			return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+		}
+		// Anything else (typically EOPNOTSUPP) just means the file system can't preallocate
+		contentLength = 0;
+	}
+
 	int ret = respond(RAP_RESPOND_CONTINUE);
 	if (ret < 0) {
+		if (!inPlace) discardUploadFile(fd, tempName);
+		else close(fd);
+		close(requestMessage->fd);
 		return ret;
 	}
 
-	char buffer[BUFFER_SIZE];
-	ssize_t bytesRead;
-
-	while ((bytesRead = read(requestMessage->fd, buffer, sizeof(buffer))) > 0) {
-		ssize_t bytesWritten = write(fd, buffer, bytesRead);
-		if (bytesWritten < bytesRead) {
-			stdLogError(errno, "Could wite data to file %s", file);
+	if (inPlace && exists) {
+		if (ftruncate(fd, 0) == -1) {
+			int e = errno;
 			close(fd);
 			close(requestMessage->fd);
-			return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+			stdLogError(e, "Could not truncate file %s", file);
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
 		}
+		// Ranges uploaded earlier say nothing about the new content
+		fremovexattr(fd, UPLOADED_RANGES_ATTRIBUTE);
+		// Truncating gave back the space reserved over the old contents so take it again
+		if (contentLength > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, contentLength);
 	}
 
-	close(fd);
+	if (receiveFileData(requestMessage->fd, fd, NULL, -1) == -1) {
+		stdLogError(errno, "Could wite data to file %s", file);
+		if (!inPlace) discardUploadFile(fd, tempName);
+		else close(fd);
+		close(requestMessage->fd);
+		return respond(RAP_RESPOND_INSUFFICIENT_STORAGE);
+	}
 	close(requestMessage->fd);
+
+	if (contentLength > 0) {
+		// Give back any reserved space the client did not use
+		off_t bytesWritten = lseek(fd, 0, SEEK_CUR);
+		if (bytesWritten != -1 && bytesWritten < contentLength) ftruncate(fd, bytesWritten);
+	}
+
+	if (inPlace) {
+		int result = syncFileData(fd);
+		close(fd);
+		if (result == -1 || syncParentDir(file) == -1 || flushPendingSyncs() == -1) {
+			return respondToSyncError(errno, file);
+		}
+		return respond(RAP_RESPOND_CREATED);
+	}
+
+	// The content must be durable before the rename is, so this is flushed straight away even for group-commit
+	if (syncFileData(fd) == -1 || flushPendingSyncs() == -1) {
+		int e = errno;
+		discardUploadFile(fd, tempName);
+		return respondToSyncError(e, file);
+	}
+
+	// Someone may have locked the old file while we were receiving; hold their lock out while we replace it.
+	int lockFd = -1;
+	if (!checkUploadUnlocked(file, &lockFd)) {
+		int e = errno;
+		discardUploadFile(fd, tempName);
+		stdLogError(e, "Could not write locked file %s", file);
+		return writeErrorResponse(RAP_RESPOND_LOCKED, strerror(e), "lock-token-submitted", file);
+	}
+	int result = commitUploadFile(fd, tempName, file);
+	int e = errno;
+	if (lockFd != -1) close(lockFd);
+	if (result == -1) {
+		stdLogError(e, "Could not replace file %s", file);
+		switch (e) {
+		case EACCES:
+		case EPERM:
+			return writeErrorResponse(RAP_RESPOND_ACCESS_DENIED, strerror(e), NULL, file);
+		case ENOSPC:
+		case EDQUOT:
+			return writeErrorResponse(RAP_RESPOND_INSUFFICIENT_STORAGE, strerror(e), NULL, file);
+		default:
+			return writeErrorResponse(RAP_RESPOND_CONFLICT, strerror(e), NULL, file);
+		}
+	}
+	if (syncParentDir(file) == -1 || flushPendingSyncs() == -1) {
+		return respondToSyncError(errno, file);
+	}
 	return respond(RAP_RESPOND_CREATED);
 }
 
@@ -1295,8 +3726,8 @@ static ssize_t writeFile(Message * requestMessage) {
 /////////
 
 static int compareDirent(const void * a, const void * b) {
-	const struct dirent * lhs = *((const struct dirent **) a);
-	const struct dirent * rhs = *((const struct dirent **) b);
+	const struct dirent * lhs = a;
+	const struct dirent * rhs = b;
 	int result = strcoll(lhs->d_name, rhs->d_name);
 	if (result != 0) {
 		return result;
@@ -1308,19 +3739,32 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 	DIR * dir = fdopendir(dirFd);
 	xmlTextWriterPtr writer = xmlNewFdTextWriter(writeFd);
 
+	// Entries are copied out because readdir() may reuse its buffer.  Only the fields used are copied since the
+	// record readdir() returned may be shorter than a struct dirent.
 	size_t entryCount = 0;
-	struct dirent ** directoryEntries = NULL;
+	struct dirent * directoryEntries = NULL;
 	struct dirent * dp;
 	while ((dp = readdir(dir)) != NULL) {
-		int index = entryCount++;
-		if (!(index & 0x7F)) {
-			directoryEntries = reallocSafe(directoryEntries, sizeof(struct dirent **) * (entryCount + 0x7F));
+		if (dp->d_name[0] != '.') {
+			int index = entryCount++;
+			if (!(index & 0x7F)) {
+				directoryEntries = reallocSafe(directoryEntries, sizeof(*directoryEntries) * (entryCount + 0x7F));
+			}
+			directoryEntries[index].d_type = dp->d_type;
+			strcpy(directoryEntries[index].d_name, dp->d_name);
 		}
-		directoryEntries[index] = dp;
 	}
 
 	qsort(directoryEntries, entryCount, sizeof(*directoryEntries), &compareDirent);
 
+	const char ** names = mallocSafe(sizeof(*names) * (entryCount ? entryCount : 1));
+	struct stat * stats = mallocSafe(sizeof(*stats) * (entryCount ? entryCount : 1));
+	int * errors = mallocSafe(sizeof(*errors) * (entryCount ? entryCount : 1));
+	for (size_t i = 0; i < entryCount; i++) {
+		names[i] = directoryEntries[i].d_name;
+	}
+	statBatch(dirFd, names, entryCount, stats, errors, 0, STATX_BASIC_STATS);
+
 	xmlTextWriterStartElement(writer, "html");
 	xmlTextWriterStartElement(writer, "head");
 	xmlTextWriterWriteElementString(writer, NULL, "title", fileName);
@@ -1337,10 +3781,9 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 	xmlTextWriterWriteElementString(writer, NULL, "th", "Mime Type");
 	xmlTextWriterWriteElementString(writer, NULL, "th", "Last Modified");
 	for (size_t i = 0; i < entryCount; i++) {
-		dp = directoryEntries[i];
-		if (dp->d_name[0] != '.') {
-			struct stat stat;
-			fstatat(dirFd, dp->d_name, &stat, 0);
+		dp = &directoryEntries[i];
+		if (!errors[i]) {
+			struct stat * stat = &stats[i];
 			char buffer[100];
 
 			xmlTextWriterStartElement(writer, "tr");
@@ -1362,7 +3805,7 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 
 			// File Size
 			if (dp->d_type == DT_REG) {
-				formatFileSize(buffer, sizeof(buffer), stat.st_size);
+				formatFileSize(buffer, sizeof(buffer), stat->st_size);
 				xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
 			} else {
 				xmlTextWriterWriteElementString(writer, NULL, "td", "-");
@@ -1373,7 +3816,7 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 					dp->d_type == DT_DIR ? "-" : findMimeType(dp->d_name)->type);
 
 			// Last Modified
-			getLocalDate(stat.st_mtime, buffer, sizeof(buffer));
+			getLocalDate(stat->st_mtime, buffer, sizeof(buffer));
 			xmlTextWriterWriteElementString(writer, NULL, "td", buffer);
 
 			xmlTextWriterEndElement(writer);
@@ -1386,6 +3829,9 @@ static void listDir(const char * fileName, int dirFd, int writeFd) {
 
 	xmlFreeTextWriter(writer);
 	closedir(dir);
+	freeSafe(names);
+	freeSafe(stats);
+	freeSafe(errors);
 	freeSafe(directoryEntries);
 }
 
@@ -1423,7 +3869,7 @@ static ssize_t readFile(Message * requestMessage) {
 
 			// we cant't lock a directory so we don't try to acquire a lock here.
 			int pipeEnds[2];
-			if (pipe(pipeEnds)) {
+			if (openResponsePipe(pipeEnds)) {
 				stdLogError(errno, "Could not create pipe to write content");
 				close(fd);
 				return respond(RAP_RESPOND_INTERNAL_ERROR);
@@ -1479,6 +3925,10 @@ static ssize_t readFile(Message * requestMessage) {
 //////////////////
 
 static int pamConverse(int n, const struct pam_message **msg, struct pam_response **resp, char * password) {
+	if (!password) {
+		// Certificate logins have no password to give
+		return PAM_CONV_ERR;
+	}
 	struct pam_response * response = mallocSafe(sizeof(struct pam_response));
 	response->resp_retcode = 0;
 	size_t passSize = strlen(password) + 1;
@@ -1493,6 +3943,8 @@ static void pamCleanup() {
 	pam_end(pamh, pamResult);
 }
 
+// If password is NULL the user has already been identified (by client certificate) so only the account checks and
+// session setup are run.
 static int pamAuthenticate(const char * user, const char * password, const char * hostname) {
 	static struct pam_conv pamc = { .conv = (int (*)(int num_msg, const struct pam_message **msg,
 			struct pam_response **resp, void *appdata_ptr)) &pamConverse };
@@ -1507,8 +3959,8 @@ static int pamAuthenticate(const char * user, const char * password, const char
 // Authenticate and start session
 	int pamResult;
 	if ((pamResult = pam_set_item(pamh, PAM_RHOST, hostname)) != PAM_SUCCESS
-			|| (pamResult = pam_set_item(pamh, PAM_RUSER, user)) != PAM_SUCCESS || (pamResult =
-					pam_authenticate(pamh, PAM_SILENT | PAM_DISALLOW_NULL_AUTHTOK)) != PAM_SUCCESS
+			|| (pamResult = pam_set_item(pamh, PAM_RUSER, user)) != PAM_SUCCESS || (password && (pamResult =
+					pam_authenticate(pamh, PAM_SILENT | PAM_DISALLOW_NULL_AUTHTOK)) != PAM_SUCCESS)
 			|| (pamResult = pam_acct_mgmt(pamh, PAM_SILENT | PAM_DISALLOW_NULL_AUTHTOK)) != PAM_SUCCESS
 			|| (pamResult = pam_setcred(pamh, PAM_ESTABLISH_CRED)) != PAM_SUCCESS || (pamResult =
 					pam_open_session(pamh, 0)) != PAM_SUCCESS) {
@@ -1560,6 +4012,12 @@ static ssize_t authenticate(Message * message) {
 	char * password = messageParamToString(&message->params[RAP_PARAM_AUTH_PASSWORD]);
 	char * rhost = messageParamToString(&message->params[RAP_PARAM_AUTH_RHOST]);
 
+	if (message->mID == RAP_REQUEST_AUTHENTICATE_CERTIFICATE) {
+		password = NULL;
+	} else if (!password) {
+		return respond(RAP_RESPOND_AUTH_FAILLED);
+	}
+
 	if (pamAuthenticate(user, password, rhost)) {
 		//stdLog("Login accepted for %s", user);
 		return respond(RAP_RESPOND_OK);
@@ -1576,6 +4034,16 @@ int main(int argCount, char * args[]) {
 	setlocale(LC_ALL, "");
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
 
+	// A client disconnecting part way through a response shows up as EPIPE on the response pipe
+	signal(SIGPIPE, SIG_IGN);
+
+	initializeUring();
+	initializeDurability(getenv("WEBDAVD_DURABILITY"));
+	initializePropFindCache();
+	initializeSyncJournal();
+	const char * maxEntries = getenv("WEBDAVD_PROPFIND_MAX_ENTRIES");
+	if (maxEntries && atol(maxEntries) > 0) propFindMaxEntries = atol(maxEntries);
+
 	pamService = getenv("WEBDAVD_PAM_SERVICE");
 	if (!pamService) pamService = "webdav";
 
@@ -1585,6 +4053,14 @@ int main(int argCount, char * args[]) {
 	chrootPath = getenv("WEBDAVD_CHROOT_PATH");
 	if (chrootPath && !strcmp("", chrootPath)) chrootPath = NULL;
 
+	const char * ipcTransport = getenv("WEBDAVD_IPC_TRANSPORT");
+	if (ipcTransport && !strcmp(ipcTransport, "shared-memory")) {
+		if (!attachRingTransport(RAP_CONTROL_SOCKET, RAP_RING_FD,
+				RAP_RING_REQUEST_EVENT_FD, RAP_RING_RESPONSE_EVENT_FD)) {
+			return 255;
+		}
+	}
+
 	ssize_t ioResult;
 	Message message;
 	do {
@@ -1596,7 +4072,7 @@ int main(int argCount, char * args[]) {
 			break;
 		}
 
-		if (message.mID == RAP_REQUEST_AUTHENTICATE) {
+		if (message.mID == RAP_REQUEST_AUTHENTICATE || message.mID == RAP_REQUEST_AUTHENTICATE_CERTIFICATE) {
 			ioResult = authenticate(&message);
 		} else {
 			stdLogError(0, "Invalid request id %d on unauthenticted worker", message.mID);
@@ -1610,6 +4086,9 @@ int main(int argCount, char * args[]) {
 		ioResult = recvMessage(RAP_CONTROL_SOCKET, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
 		if (ioResult <= 0) return ioResult == 0 ? 0 : 1;
 
+		// Keep the sync-collection journal from falling behind the inotify queue
+		if (syncCollectionCount) processPropFindCacheEvents(NULL, 0);
+
 		switch (message.mID) {
 		case RAP_REQUEST_GET:
 			ioResult = readFile(&message);
@@ -1638,6 +4117,9 @@ int main(int argCount, char * args[]) {
 		case RAP_REQUEST_LOCK:
 			ioResult = lockFile(&message);
 			break;
+		case RAP_REQUEST_REPORT:
+			ioResult = report(&message);
+			break;
 		default:
 			if (message.mID >= 400 && message.mID <= 499) {
 				const char * location = messageParamToString(&message.params[RAP_PARAM_ERROR_LOCATION]);
@@ -1,10 +1,14 @@
 #include "shared.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -17,6 +21,19 @@ size_t getWebDate(time_t rawtime, char * buf, size_t bufSize) {
 	return strftime(buf, bufSize, "%a, %d %b %Y %H:%M:%S %Z", timeinfo);
 }
 
+// Reads a date in the form written by getWebDate().  Returns 0 if it isn't one.
+int parseWebDate(const char * date, time_t * rawtime) {
+	struct tm timeinfo;
+	memset(&timeinfo, 0, sizeof(timeinfo));
+	while (*date == ' ' || *date == '\t' || *date == '\n' || *date == '\r') date++;
+	const char * end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+	if (!end) return 0;
+	while (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r') end++;
+	if (*end) return 0;
+	*rawtime = timegm(&timeinfo);
+	return 1;
+}
+
 size_t getLocalDate(time_t rawtime, char * buf, size_t bufSize) {
 	struct tm * timeinfo = localtime(&rawtime);
 	return strftime(buf, bufSize, "%b %d %Y %H:%M:%S", timeinfo);
@@ -102,6 +119,385 @@ void freeSafe(void * mem) {
 	free(mem);
 }
 
+// What is actually sent on the socket.  Message holds pointers and so can't be sent as is.
+typedef struct MessageHeader {
+	uint16_t version;
+	uint16_t paramCount;
+	int32_t mID;
+	uint32_t paramLengths[MAX_MESSAGE_PARAMS];
+} MessageHeader;
+
+//////////////////////////
+// Shared Memory Rings //
+//////////////////////////
+
+// Optionally messages can be passed through a pair of single producer / single consumer rings in shared memory
+// instead of through the socket.  The socket is then only used to pass file descriptors and to detect when the
+// other end has gone away.  A wakeup (eventfd write) is only sent when the consumer has actually gone to sleep, or
+// when the producer is asleep waiting for room in a full ring.
+
+#define RING_DATA_SIZE (64 * 1024)
+#define RING_WRAP 0xFFFFFFFF
+#define RING_FLAG_FD 1
+#define RING_SPIN_COUNT 200
+#define RING_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+typedef struct RingRecord {
+	uint32_t length;
+	uint32_t flags;
+} RingRecord;
+
+typedef struct RingBuffer {
+	uint32_t head;      // Only written by the producer
+	uint32_t full;      // Set by the producer while it is asleep waiting for room
+	char headPadding[56];
+	uint32_t tail;      // Only written by the consumer
+	uint32_t waiting;   // Set by the consumer while it is asleep on the eventfd
+	char tailPadding[56];
+	unsigned char data[RING_DATA_SIZE];
+} RingBuffer;
+
+typedef struct RingShared {
+	RingBuffer toRap;
+	RingBuffer fromRap;
+} RingShared;
+
+// The peer can write to the whole of the shared memory so nothing read from it is trusted.  Each side keeps its own
+// copy of the only index it writes and every record is checked against the ring before it is read.
+typedef struct RingTransport {
+	RingShared * shared;
+	RingBuffer * sendRing;
+	RingBuffer * recvRing;
+	uint32_t sendHead;
+	uint32_t recvTail;
+	int sendEventFd;
+	int recvEventFd;
+} RingTransport;
+
+// Indexed by socket fd in blocks of RING_TRANSPORT_BLOCK_SIZE which are only allocated once a socket in them is
+// registered, so a rap with its one socket only pays for one small block.  Blocks are never moved or freed which
+// lets other threads look sockets up without a lock.
+#define RING_TRANSPORT_BLOCK_SIZE 1024
+#define RING_TRANSPORT_BLOCKS 1024
+static RingTransport ** ringTransports[RING_TRANSPORT_BLOCKS];
+
+static RingTransport ** getRingTransportSlot(int sock, int create) {
+	if (sock < 0 || sock >= RING_TRANSPORT_BLOCK_SIZE * RING_TRANSPORT_BLOCKS) return NULL;
+	RingTransport *** block = &ringTransports[sock / RING_TRANSPORT_BLOCK_SIZE];
+	RingTransport ** blockData = __atomic_load_n(block, __ATOMIC_ACQUIRE);
+	if (!blockData && create) {
+		RingTransport ** newBlock = mallocSafe(sizeof(*newBlock) * RING_TRANSPORT_BLOCK_SIZE);
+		memset(newBlock, 0, sizeof(*newBlock) * RING_TRANSPORT_BLOCK_SIZE);
+		if (__atomic_compare_exchange_n(block, &blockData, newBlock, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			blockData = newBlock;
+		} else {
+			// Another thread got there first
+			freeSafe(newBlock);
+		}
+	}
+	return blockData ? &blockData[sock % RING_TRANSPORT_BLOCK_SIZE] : NULL;
+}
+
+static RingTransport * getRingTransport(int sock) {
+	RingTransport ** slot = getRingTransportSlot(sock, 0);
+	return slot ? __atomic_load_n(slot, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static int registerRingTransport(int sock, int memFd, int isRap, int requestEventFd, int responseEventFd) {
+	RingTransport ** slot = getRingTransportSlot(sock, 1);
+	if (!slot) {
+		stdLogError(0, "Socket %d can not use shared memory transport", sock);
+		return 0;
+	}
+	RingShared * shared = mmap(NULL, sizeof(RingShared), PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+	if (shared == MAP_FAILED) {
+		stdLogError(errno, "Could not map shared memory transport");
+		return 0;
+	}
+	RingTransport * ring = mallocSafe(sizeof(*ring));
+	ring->shared = shared;
+	ring->sendRing = isRap ? &shared->fromRap : &shared->toRap;
+	ring->recvRing = isRap ? &shared->toRap : &shared->fromRap;
+	ring->sendHead = 0;
+	ring->recvTail = 0;
+	ring->sendEventFd = isRap ? responseEventFd : requestEventFd;
+	ring->recvEventFd = isRap ? requestEventFd : responseEventFd;
+	__atomic_store_n(slot, ring, __ATOMIC_RELEASE);
+	return 1;
+}
+
+int createRingTransport(int sock, int * memFd, int * requestEventFd, int * responseEventFd) {
+	*memFd = memfd_create("webdavd-rap", MFD_CLOEXEC);
+	if (*memFd == -1 || ftruncate(*memFd, sizeof(RingShared)) == -1) {
+		stdLogError(errno, "Could not create shared memory transport");
+		if (*memFd != -1) close(*memFd);
+		return 0;
+	}
+	*requestEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	*responseEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (*requestEventFd == -1 || *responseEventFd == -1
+			|| !registerRingTransport(sock, *memFd, 0, *requestEventFd, *responseEventFd)) {
+		stdLogError(errno, "Could not create shared memory transport");
+		if (*requestEventFd != -1) close(*requestEventFd);
+		if (*responseEventFd != -1) close(*responseEventFd);
+		close(*memFd);
+		return 0;
+	}
+	return 1;
+}
+
+int attachRingTransport(int sock, int memFd, int requestEventFd, int responseEventFd) {
+	int result = registerRingTransport(sock, memFd, 1, requestEventFd, responseEventFd);
+	close(memFd);
+	return result;
+}
+
+void closeMessageSocket(int sock) {
+	RingTransport * ring = getRingTransport(sock);
+	if (ring) {
+		__atomic_store_n(getRingTransportSlot(sock, 0), NULL, __ATOMIC_RELEASE);
+		munmap(ring->shared, sizeof(RingShared));
+		close(ring->sendEventFd);
+		close(ring->recvEventFd);
+		freeSafe(ring);
+	}
+	close(sock);
+}
+
+// The socket's timeout (SO_RCVTIMEO or SO_SNDTIMEO) in milliseconds for poll(), -1 if none is set.
+static int getRingTimeout(int sock, int option) {
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 0 };
+	socklen_t timeoutSize = sizeof(timeout);
+	getsockopt(sock, SOL_SOCKET, option, &timeout, &timeoutSize);
+	return timeout.tv_sec || timeout.tv_usec ? timeout.tv_sec * 1000 + timeout.tv_usec / 1000 : -1;
+}
+
+// Waits until there are at least size free bytes after head in the ring.  Returns 1 when there is room or -1 if the
+// other end went away or the socket's send timeout passed.
+static int waitForRingSpace(RingTransport * ring, int sock, uint32_t head, size_t size) {
+	RingBuffer * ringBuffer = ring->sendRing;
+	if (RING_DATA_SIZE - (head - __atomic_load_n(&ringBuffer->tail, __ATOMIC_ACQUIRE)) >= size) {
+		return 1;
+	}
+
+	int timeoutMs = getRingTimeout(sock, SO_SNDTIMEO);
+	while (1) {
+		__atomic_store_n(&ringBuffer->full, 1, __ATOMIC_SEQ_CST);
+		if (RING_DATA_SIZE - (head - __atomic_load_n(&ringBuffer->tail, __ATOMIC_SEQ_CST)) >= size) {
+			__atomic_store_n(&ringBuffer->full, 0, __ATOMIC_RELAXED);
+			return 1;
+		}
+		struct pollfd fds[2] = {
+				{ .fd = ring->recvEventFd, .events = POLLIN },
+				{ .fd = sock, .events = POLLRDHUP } };
+		int result = poll(fds, 2, timeoutMs);
+		__atomic_store_n(&ringBuffer->full, 0, __ATOMIC_RELAXED);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait to send message");
+			return -1;
+		} else if (result == 0) {
+			errno = EAGAIN;
+			stdLogError(errno, "Could not send message");
+			return -1;
+		}
+		if (fds[0].revents & POLLIN) {
+			uint64_t ignored;
+			size_t ignoredSize __attribute__ ((unused)) = read(ring->recvEventFd, &ignored, sizeof(ignored));
+		}
+		if (RING_DATA_SIZE - (head - __atomic_load_n(&ringBuffer->tail, __ATOMIC_ACQUIRE)) >= size) {
+			return 1;
+		}
+		if (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+			errno = EPIPE;
+			stdLogError(errno, "Could not send message");
+			return -1;
+		}
+	}
+}
+
+static ssize_t sendRingMessage(RingTransport * ring, int sock, Message * message, MessageHeader * header) {
+	size_t payloadSize = sizeof(*header);
+	for (int i = 0; i < message->paramCount; i++) {
+		payloadSize += message->params[i].iov_len;
+	}
+	size_t recordSize = sizeof(RingRecord) + RING_ALIGN(payloadSize);
+	if (recordSize > RING_DATA_SIZE / 2) {
+		stdLogError(0, "Message too large for shared memory transport %zd", payloadSize);
+		if (message->fd != -1) close(message->fd);
+		return -1;
+	}
+
+	// File handles can't go through memory so go through the socket ahead of the message that refers to them
+	if (message->fd != -1) {
+		char ctrl_buf[CMSG_SPACE(sizeof(int))];
+		char marker = 'F';
+		struct iovec part = { .iov_base = &marker, .iov_len = 1 };
+		struct msghdr msg = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = ctrl_buf, .msg_controllen =
+				sizeof(ctrl_buf) };
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		*((int *) CMSG_DATA(cmsg)) = message->fd;
+		ssize_t result = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		close(message->fd);
+		if (result < 0) {
+			stdLogError(errno, "Could not send file handle");
+			return -1;
+		}
+	}
+
+	RingBuffer * ringBuffer = ring->sendRing;
+	uint32_t head = ring->sendHead;
+	uint32_t position = head % RING_DATA_SIZE;
+	size_t wrapSize = RING_DATA_SIZE - position < recordSize ? RING_DATA_SIZE - position : 0;
+	// The other side only ever has one message outstanding so this should not normally wait
+	if (waitForRingSpace(ring, sock, head, wrapSize + recordSize) < 0) {
+		return -1;
+	}
+	if (wrapSize) {
+		((RingRecord *) (ringBuffer->data + position))->length = RING_WRAP;
+		head += wrapSize;
+		position = 0;
+	}
+
+	RingRecord * record = (RingRecord *) (ringBuffer->data + position);
+	record->length = payloadSize;
+	record->flags = message->fd != -1 ? RING_FLAG_FD : 0;
+	unsigned char * data = (unsigned char *) (record + 1);
+	memcpy(data, header, sizeof(*header));
+	data += sizeof(*header);
+	for (int i = 0; i < message->paramCount; i++) {
+		if (message->params[i].iov_len) {
+			memcpy(data, message->params[i].iov_base, message->params[i].iov_len);
+			data += message->params[i].iov_len;
+		}
+	}
+	ring->sendHead = head + recordSize;
+	__atomic_store_n(&ringBuffer->head, ring->sendHead, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ringBuffer->waiting, __ATOMIC_SEQ_CST)) {
+		uint64_t wake = 1;
+		if (write(ring->sendEventFd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+			stdLogError(errno, "Could not wake message receiver");
+		}
+	}
+	return payloadSize;
+}
+
+// Waits for the ring to become non-empty.  Returns 1 when a message is ready, 0 if the other end went away and -1 on
+// error (including the socket's receive timeout passing).
+static int waitForRingMessage(RingTransport * ring, int sock) {
+	RingBuffer * ringBuffer = ring->recvRing;
+	for (int i = 0; i < RING_SPIN_COUNT; i++) {
+		if (__atomic_load_n(&ringBuffer->head, __ATOMIC_ACQUIRE) != ring->recvTail) {
+			return 1;
+		}
+	}
+
+	int timeoutMs = getRingTimeout(sock, SO_RCVTIMEO);
+
+	while (1) {
+		__atomic_store_n(&ringBuffer->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ringBuffer->head, __ATOMIC_SEQ_CST) != ring->recvTail) {
+			__atomic_store_n(&ringBuffer->waiting, 0, __ATOMIC_RELAXED);
+			return 1;
+		}
+		struct pollfd fds[2] = {
+				{ .fd = ring->recvEventFd, .events = POLLIN },
+				{ .fd = sock, .events = POLLRDHUP } };
+		int result = poll(fds, 2, timeoutMs);
+		__atomic_store_n(&ringBuffer->waiting, 0, __ATOMIC_RELAXED);
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait for message");
+			return -1;
+		} else if (result == 0) {
+			errno = EAGAIN;
+			stdLogError(errno, "Could not receive message");
+			return -1;
+		}
+		if (fds[0].revents & POLLIN) {
+			uint64_t ignored;
+			size_t ignoredSize __attribute__ ((unused)) = read(ring->recvEventFd, &ignored, sizeof(ignored));
+		}
+		if (__atomic_load_n(&ringBuffer->head, __ATOMIC_ACQUIRE) != ring->recvTail) {
+			return 1;
+		}
+		if (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) {
+			return 0;
+		}
+	}
+}
+
+static ssize_t recvRingMessage(RingTransport * ring, int sock, Message * message, MessageHeader * header,
+		char * incomingBuffer, size_t incomingBufferSize) {
+	int waitResult = waitForRingMessage(ring, sock);
+	if (waitResult <= 0) {
+		return waitResult;
+	}
+
+	// tail is always a multiple of 8 so there is always room for a record header at it
+	RingBuffer * ringBuffer = ring->recvRing;
+	uint32_t tail = ring->recvTail;
+	uint32_t position = tail % RING_DATA_SIZE;
+	RingRecord * record = (RingRecord *) (ringBuffer->data + position);
+	// Each field is read once; the peer may change them while we look
+	uint32_t length = __atomic_load_n(&record->length, __ATOMIC_RELAXED);
+	if (length == RING_WRAP) {
+		tail += RING_DATA_SIZE - position;
+		position = 0;
+		record = (RingRecord *) ringBuffer->data;
+		length = __atomic_load_n(&record->length, __ATOMIC_RELAXED);
+	}
+	size_t payloadSize = length;
+	int flags = __atomic_load_n(&record->flags, __ATOMIC_RELAXED);
+	if (payloadSize < sizeof(*header) || payloadSize > RING_DATA_SIZE - position - sizeof(RingRecord)
+			|| payloadSize - sizeof(*header) > incomingBufferSize) {
+		// The peer is broken or hostile; either way it is finished with
+		stdLogError(0, "Invalid message received from shared memory %zd", payloadSize);
+		return 0;
+	}
+	memcpy(header, record + 1, sizeof(*header));
+	memcpy(incomingBuffer, ((unsigned char *) (record + 1)) + sizeof(*header), payloadSize - sizeof(*header));
+	ssize_t size = payloadSize;
+	ring->recvTail = tail + sizeof(RingRecord) + RING_ALIGN(payloadSize);
+	__atomic_store_n(&ringBuffer->tail, ring->recvTail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ringBuffer->full, __ATOMIC_SEQ_CST)) {
+		uint64_t wake = 1;
+		if (write(ring->sendEventFd, &wake, sizeof(wake)) < 0 && errno != EAGAIN) {
+			stdLogError(errno, "Could not wake message sender");
+		}
+	}
+
+	message->fd = -1;
+	if (flags & RING_FLAG_FD) {
+		char ctrl_buf[CMSG_SPACE(sizeof(int))];
+		char marker;
+		struct iovec part = { .iov_base = &marker, .iov_len = 1 };
+		struct msghdr msg = { .msg_iov = &part, .msg_iovlen = 1, .msg_control = ctrl_buf, .msg_controllen =
+				sizeof(ctrl_buf) };
+		ssize_t result;
+		do {
+			result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		} while (result < 0 && errno == EINTR);
+		struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+		if (result > 0 && cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(int)) && cmsg->cmsg_level == SOL_SOCKET
+				&& cmsg->cmsg_type == SCM_RIGHTS) {
+			message->fd = *((int *) CMSG_DATA(cmsg));
+		} else {
+			stdLogError(result < 0 ? errno : 0, "Could not receive file handle for message");
+			size = -1;
+		}
+	}
+	return size;
+}
+
+//////////////////////////////
+// End Shared Memory Rings //
+//////////////////////////////
+
 ssize_t sendMessage(int sock, Message * message) {
 	//stdLog("sendm %d", sock);
 	ssize_t size;
@@ -117,16 +513,29 @@ ssize_t sendMessage(int sock, Message * message) {
 		return -1;
 	}
 
+	MessageHeader header = {
+			.version = MESSAGE_VERSION,
+			.paramCount = message->paramCount,
+			.mID = message->mID };
+	for (int i = 0; i < message->paramCount; i++) {
+		header.paramLengths[i] = message->params[i].iov_len;
+	}
+
+	RingTransport * ring = getRingTransport(sock);
+	if (ring) {
+		return sendRingMessage(ring, sock, message, &header);
+	}
+
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
 	msg.msg_iov = messageParts;
 	msg.msg_iovlen = message->paramCount + 1;
-	messageParts[0].iov_base = message;
-	messageParts[0].iov_len = sizeof(*message);
+	msg.msg_flags = 0;
+	messageParts[0].iov_base = &header;
+	messageParts[0].iov_len = sizeof(header);
 	memcpy(&(messageParts[1]), message->params, sizeof(*message->params) * message->paramCount);
 
 	if (message->fd != -1) {
-		memset(&ctrl_buf, 0, sizeof(ctrl_buf));
 		msg.msg_control = &ctrl_buf;
 		msg.msg_controllen = sizeof(ctrl_buf);
 		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
@@ -150,12 +559,58 @@ ssize_t sendMessage(int sock, Message * message) {
 	return size;
 }
 
+// Unpacks a received header into message.  The params are left pointing into incomingBuffer.
+static ssize_t decodeMessage(MessageHeader * header, ssize_t size, Message * message, char * incomingBuffer) {
+	if (size < sizeof(*header) || header->version != MESSAGE_VERSION || header->paramCount > MAX_MESSAGE_PARAMS) {
+		if (size >= sizeof(header->version) && header->version != MESSAGE_VERSION) {
+			stdLogError(0, "Message version %d received, expected %d: webdavd and rap are from different builds",
+					(int) header->version, MESSAGE_VERSION);
+		} else {
+			stdLogError(0, "Invalid message received %zd %d", size, (int) header->paramCount);
+		}
+		if (message->fd != -1) {
+			close(message->fd);
+		}
+		return -1;
+	}
+
+	message->mID = header->mID;
+	message->paramCount = header->paramCount;
+	size_t dataSize = size - sizeof(*header);
+	size_t offset = 0;
+	for (int i = 0; i < message->paramCount; i++) {
+		if (header->paramLengths[i] > dataSize - offset) {
+			stdLogError(0, "Invalid message received: parts too long");
+			if (message->fd != -1) {
+				close(message->fd);
+			}
+			return -1;
+		}
+		message->params[i].iov_base = (header->paramLengths[i] > 0 ? incomingBuffer + offset : NULL);
+		message->params[i].iov_len = header->paramLengths[i];
+		offset += header->paramLengths[i];
+	}
+	for (int i = message->paramCount; i < MAX_MESSAGE_PARAMS; i++) {
+		message->params[i].iov_base = NULL;
+		message->params[i].iov_len = 0;
+	}
+
+	return size;
+}
+
 ssize_t recvMessage(int sock, Message * message, char * incomingBuffer, size_t incomingBufferSize) {
 	//stdLog("recvm %d", sock);
 
 	struct msghdr msg;
 	char ctrl_buf[CMSG_SPACE(sizeof(int))];
 	struct iovec messageParts[2];
+	MessageHeader header;
+
+	RingTransport * ring = getRingTransport(sock);
+	if (ring) {
+		ssize_t size = recvRingMessage(ring, sock, message, &header, incomingBuffer, incomingBufferSize);
+		return size <= 0 ? size : decodeMessage(&header, size, message, incomingBuffer);
+	}
 
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
@@ -163,24 +618,15 @@ ssize_t recvMessage(int sock, Message * message, char * incomingBuffer, size_t i
 	msg.msg_iovlen = 2;
 	msg.msg_control = ctrl_buf;
 	msg.msg_controllen = sizeof(ctrl_buf);
-	messageParts[0].iov_base = message;
-	messageParts[0].iov_len = sizeof(*message);
+	messageParts[0].iov_base = &header;
+	messageParts[0].iov_len = sizeof(header);
 	messageParts[1].iov_base = incomingBuffer;
 	messageParts[1].iov_len = incomingBufferSize;
 
-	memset(incomingBuffer, 0, incomingBufferSize);
-
-	ssize_t size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
-	// this is there to stop random EINTR failures. never yet found out what cause them
-	// but this seems to fix them.
-	if (size < 0 && errno == EINTR) {
-		int retryCount = 20;
-		do {
-			//stdLogError(EINTR, "Could not receive socket message intr %d %zd ... retry", sock, size);
-			retryCount--;
-			size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
-		} while (size < 0 && errno == EINTR && retryCount > 0);
-	}
+	ssize_t size;
+	do {
+		size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (size < 0 && errno == EINTR);
 	if (size <= 0) {
 		if (size < 0) {
 			stdLogError(errno, "Could not receive socket message %d %zd", sock, size);
@@ -197,32 +643,15 @@ ssize_t recvMessage(int sock, Message * message, char * incomingBuffer, size_t i
 		message->fd = -1;
 	}
 
-	if (size < sizeof(*message) || message->paramCount < 0 || message->paramCount > MAX_MESSAGE_PARAMS) {
-		stdLogError(0, "Invalid message received %zd %d", size, message->paramCount);
+	if (msg.msg_flags & MSG_TRUNC) {
+		stdLogError(0, "Invalid message received %zd (truncated)", size);
 		if (message->fd != -1) {
 			close(message->fd);
 		}
 		return -1;
 	}
 
-	char * partPtr = incomingBuffer;
-	for (int i = 0; i < message->paramCount; i++) {
-		message->params[i].iov_base = (message->params[i].iov_len > 0 ? partPtr : NULL);
-		partPtr += message->params[i].iov_len;
-		if (partPtr > incomingBuffer + size - sizeof(*message)) {
-			stdLogError(0, "Invalid message received: parts too long\n");
-			if (message->fd != -1) {
-				close(message->fd);
-			}
-			return -1;
-		}
-	}
-	for (int i = message->paramCount; i < MAX_MESSAGE_PARAMS; i++) {
-		message->params[i].iov_base = NULL;
-		message->params[i].iov_len = 0;
-	}
-
-	return size;
+	return decodeMessage(&header, size, message, incomingBuffer);
 }
 
 ssize_t sendRecvMessage(int sock, Message * message, char * incomingBuffer, size_t incomingBufferSize) {
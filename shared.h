@@ -1,6 +1,7 @@
 #ifndef WEBDAV_SHARED_H
 #define WEBDAV_SHARED_H
 
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <sys/file.h>
@@ -11,9 +12,12 @@
 
 #define BUFFER_SIZE 40960
 #define MAX_VARABLY_DEFINED_ARRAY 40960
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#define RESPONSE_PIPE_SIZE (256 * 1024)
 
 typedef enum RapConstant {
 	RAP_REQUEST_AUTHENTICATE = 1,
+	RAP_REQUEST_AUTHENTICATE_CERTIFICATE, // The user has been identified by webdavd, no password is sent
 
 	// sent by startProcessingRequest to start processing an HTTP method
 	RAP_REQUEST_GET,
@@ -25,6 +29,7 @@ typedef enum RapConstant {
 	RAP_REQUEST_MOVE,
 	RAP_REQUEST_COPY,
 	RAP_REQUEST_DELETE,
+	RAP_REQUEST_REPORT,
 
 	// sent by rap, processed by finishProcessingRequest
 	RAP_INTERIM_RESPOND_LOCK,
@@ -39,12 +44,14 @@ typedef enum RapConstant {
 	RAP_RESPOND_CREATED = 201,
 	RAP_RESPOND_OK_NO_CONTENT = 204,
 	RAP_RESPOND_MULTISTATUS = 207,
+	RAP_RESPOND_NOT_MODIFIED = 304,
 	RAP_RESPOND_BAD_CLIENT_REQUEST = 400,
 	RAP_RESPOND_AUTH_FAILLED = 401,
 	RAP_RESPOND_ACCESS_DENIED = 403,
 	RAP_RESPOND_NOT_FOUND = 404,
 	RAP_RESPOND_CONFLICT = 409,
 	RAP_RESPOND_URI_TOO_LARGE = 414,
+	RAP_RESPOND_RANGE_NOT_SATISFIABLE = 416,
 	RAP_RESPOND_LOCKED = 423,
 	RAP_RESPOND_HEADER_TOO_LARGE = 431,
 	RAP_RESPOND_INTERNAL_ERROR = 500,
@@ -62,11 +69,15 @@ typedef enum RapConstant {
 #define RAP_PARAM_REQUEST_FILE      1
 #define RAP_PARAM_REQUEST_DEPTH     2
 #define RAP_PARAM_REQUEST_TARGET    2
+#define RAP_PARAM_REQUEST_LENGTH    2
+#define RAP_PARAM_REQUEST_RANGE     3
+#define RAP_PARAM_REQUEST_IF_NONE_MATCH 3
 
 // Generic Response
 #define RAP_PARAM_RESPONSE_DATE     0
 #define RAP_PARAM_RESPONSE_MIME     1
 #define RAP_PARAM_RESPONSE_LOCATION 2
+#define RAP_PARAM_RESPONSE_ETAG     3
 
 // Lock interim response
 #define RAP_PARAM_LOCK_LOCATION     0
@@ -116,13 +127,17 @@ char * copyString(const char * string);
 
 size_t timeNow(char * buf, size_t bufSize);
 size_t getWebDate(time_t rawtime, char * buf, size_t bufSize);
+int parseWebDate(const char * date, time_t * rawtime);
 size_t getLocalDate(time_t rawtime, char * buf, size_t bufSize);
 
 void stdLog(const char * str, ...);
 void stdLogError(int errorNumber, const char * str, ...);
 
-#define MAX_MESSAGE_PARAMS 3
-#define INCOMING_BUFFER_SIZE 4096
+#define MAX_MESSAGE_PARAMS 4
+#define INCOMING_BUFFER_SIZE 16384
+// Must be incremented whenever the wire format or the meaning of any RapConstant changes.  webdavd and the rap
+// refuse to talk to each other if they disagree.
+#define MESSAGE_VERSION 4
 typedef struct iovec MessageParam;
 #define NULL_PARAM ( ( MessageParam ) { .iov_base = NULL, .iov_len = 0} )
 
@@ -133,6 +148,15 @@ typedef struct Message {
 	MessageParam params[MAX_MESSAGE_PARAMS];
 } Message;
 
+// Optional shared memory transport (see shared.c).  The rap finds its end of the transport on these fds.
+#define RAP_RING_FD 4
+#define RAP_RING_REQUEST_EVENT_FD 5
+#define RAP_RING_RESPONSE_EVENT_FD 6
+
+int createRingTransport(int sock, int * memFd, int * requestEventFd, int * responseEventFd);
+int attachRingTransport(int sock, int memFd, int requestEventFd, int responseEventFd);
+void closeMessageSocket(int sock);
+
 ssize_t sendMessage(int sock, Message * message);
 ssize_t recvMessage(int sock, Message * message, char * incomingBuffer, size_t incomingBufferSize);
 ssize_t sendRecvMessage(int sock, Message * message, char * incomingBuffer, size_t incomingBufferSize);
@@ -0,0 +1,454 @@
+#include "shared.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/vfs.h>
+
+#define URING_ENTRIES 64
+#define URING_MAX_WORKERS 64
+#define STAT_THREADS 8
+#define COPY_CHUNK_SIZE 65536
+#define COPY_CHUNKS 8
+
+typedef struct Uring {
+	int fd;
+	unsigned int sqEntries;
+	unsigned int sqMask;
+	unsigned int cqMask;
+	unsigned int sqeTail;
+	unsigned int * sqHead;
+	unsigned int * sqTail;
+	unsigned int * cqHead;
+	unsigned int * cqTail;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+} Uring;
+
+static Uring ring = { .fd = -1 };
+static char * copyBuffers = NULL;
+
+////////////////////
+// Ring Managment //
+////////////////////
+
+static int uringSupportsOps(int fd, const int * ops, int opCount) {
+	size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe * probe = mallocSafe(probeSize);
+	memset(probe, 0, probeSize);
+	int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	for (int i = 0; supported && i < opCount; i++) {
+		supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+	freeSafe(probe);
+	return supported;
+}
+
+int initializeUring() {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd == -1) {
+		// ENOSYS, or EPERM when disabled by kernel.io_uring_disabled or a seccomp filter
+		return 0;
+	}
+
+	static const int requiredOps[] = { IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_UNLINKAT };
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+			|| !uringSupportsOps(fd, requiredOps, sizeof(requiredOps) / sizeof(*requiredOps))) {
+		close(fd);
+		return 0;
+	}
+
+	size_t sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ringSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+	char * ringMemory = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+			IORING_OFF_SQ_RING);
+	if (ringMemory == MAP_FAILED) {
+		stdLogError(errno, "Could not map io_uring");
+		close(fd);
+		return 0;
+	}
+	size_t sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	struct io_uring_sqe * sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+			IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		stdLogError(errno, "Could not map io_uring");
+		munmap(ringMemory, ringSize);
+		close(fd);
+		return 0;
+	}
+
+	ring.sqEntries = params.sq_entries;
+	ring.sqMask = *(unsigned int *) (ringMemory + params.sq_off.ring_mask);
+	ring.cqMask = *(unsigned int *) (ringMemory + params.cq_off.ring_mask);
+	ring.sqHead = (unsigned int *) (ringMemory + params.sq_off.head);
+	ring.sqTail = (unsigned int *) (ringMemory + params.sq_off.tail);
+	ring.cqHead = (unsigned int *) (ringMemory + params.cq_off.head);
+	ring.cqTail = (unsigned int *) (ringMemory + params.cq_off.tail);
+	ring.cqes = (struct io_uring_cqe *) (ringMemory + params.cq_off.cqes);
+	ring.sqes = sqes;
+	ring.sqeTail = *ring.sqTail;
+
+	// Submission entries are always used in order so the indirection array never changes
+	unsigned int * sqArray = (unsigned int *) (ringMemory + params.sq_off.array);
+	for (unsigned int i = 0; i < params.sq_entries; i++) {
+		sqArray[i] = i;
+	}
+
+	// Blocking operations such as statx are handed to kernel worker threads, which is what lets a batch of stats
+	// on a network file system run in parallel.  Keep the number of those threads bounded (needs linux 5.15).
+	unsigned int maxWorkers[2] = { URING_MAX_WORKERS, URING_MAX_WORKERS };
+	syscall(__NR_io_uring_register, fd, IORING_REGISTER_IOWQ_MAX_WORKERS, maxWorkers, 2);
+
+	copyBuffers = mallocSafe(COPY_CHUNKS * COPY_CHUNK_SIZE);
+	ring.fd = fd;
+	return 1;
+}
+
+static struct io_uring_sqe * getSqe() {
+	struct io_uring_sqe * sqe = &ring.sqes[ring.sqeTail & ring.sqMask];
+	ring.sqeTail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// Waits for the entries the kernel has already taken from a failed batch.  Until they complete they may still write
+// to the caller's buffers, and their completions must not be mistaken for the next batch's.  The ring is then shut
+// down so that callers use their fallbacks from now on.
+static void abandonBatch(int * results, unsigned int start, unsigned int completed) {
+	// Withdraw whatever the kernel hasn't taken yet
+	unsigned int head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+	unsigned int taken = head - start;
+	__atomic_store_n(ring.sqTail, head, __ATOMIC_RELEASE);
+	ring.sqeTail = head;
+
+	while (completed < taken) {
+		unsigned int cqHead = *ring.cqHead;
+		unsigned int cqTail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		while (cqHead != cqTail) {
+			results[ring.cqes[cqHead & ring.cqMask].user_data] = ring.cqes[cqHead & ring.cqMask].res;
+			cqHead++;
+			completed++;
+		}
+		__atomic_store_n(ring.cqHead, cqHead, __ATOMIC_RELEASE);
+
+		if (completed < taken && syscall(__NR_io_uring_enter, ring.fd, 0, taken - completed,
+				IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			// Returning now would leave the kernel writing into memory that is about to be reused
+			stdLogError(errno, "Could not wait for io_uring entries in flight");
+			exit(255);
+		}
+	}
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+// Submits every queued entry and waits for all of them to complete.  The result of each entry is written to
+// results[user_data].  Callers never queue more than sqEntries at once so the completion queue can not overflow.
+static int submitAndWait(int * results) {
+	unsigned int start = *ring.sqTail;
+	unsigned int count = ring.sqeTail - start;
+	__atomic_store_n(ring.sqTail, ring.sqeTail, __ATOMIC_RELEASE);
+
+	unsigned int toSubmit = count;
+	unsigned int completed = 0;
+	while (completed < count) {
+		unsigned int head = *ring.cqHead;
+		unsigned int tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe * cqe = &ring.cqes[head & ring.cqMask];
+			results[cqe->user_data] = cqe->res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+		if (completed < count) {
+			int submitted = syscall(__NR_io_uring_enter, ring.fd, toSubmit, count - completed,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+			if (submitted > 0) {
+				toSubmit -= submitted;
+			} else if (submitted == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				stdLogError(errno, "io_uring_enter failed");
+				abandonBatch(results, start, completed);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+////////////////////////
+// End Ring Managment //
+////////////////////////
+
+//////////
+// Stat //
+//////////
+
+static void statxToStat(struct stat * stat, const struct statx * statx) {
+	memset(stat, 0, sizeof(*stat));
+	stat->st_dev = makedev(statx->stx_dev_major, statx->stx_dev_minor);
+	stat->st_ino = statx->stx_ino;
+	stat->st_mode = statx->stx_mode;
+	stat->st_nlink = statx->stx_nlink;
+	stat->st_uid = statx->stx_uid;
+	stat->st_gid = statx->stx_gid;
+	stat->st_rdev = makedev(statx->stx_rdev_major, statx->stx_rdev_minor);
+	stat->st_size = statx->stx_size;
+	stat->st_blksize = statx->stx_blksize;
+	stat->st_blocks = statx->stx_blocks;
+	stat->st_atim.tv_sec = statx->stx_atime.tv_sec;
+	stat->st_atim.tv_nsec = statx->stx_atime.tv_nsec;
+	stat->st_mtim.tv_sec = statx->stx_mtime.tv_sec;
+	stat->st_mtim.tv_nsec = statx->stx_mtime.tv_nsec;
+	stat->st_ctim.tv_sec = statx->stx_ctime.tv_sec;
+	stat->st_ctim.tv_nsec = statx->stx_ctime.tv_nsec;
+}
+
+typedef struct StatJob {
+	int dirFd;
+	const char * const * names;
+	struct stat * stats;
+	int * errors;
+	int flags;
+	unsigned int mask;
+	size_t count;
+	size_t next;
+} StatJob;
+
+static void * statJobWorker(void * jobPtr) {
+	StatJob * job = jobPtr;
+	size_t i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count) {
+		struct statx statBuffer;
+		if (statx(job->dirFd, job->names[i], job->flags, job->mask, &statBuffer) == -1) {
+			job->errors[i] = errno;
+		} else {
+			job->errors[i] = 0;
+			statxToStat(&job->stats[i], &statBuffer);
+		}
+	}
+	return NULL;
+}
+
+int isNetworkFileSystem(int fd) {
+	static const long networkFileSystems[] = { 0x6969 /* NFS */, 0x517B /* SMB */, 0xFF534D42 /* CIFS */,
+			0xFE534D42 /* SMB2 */, 0x65735546 /* FUSE */, 0x00C36400 /* CEPH */, 0x01021997 /* 9P */ };
+	struct statfs fsStat;
+	if (fstatfs(fd, &fsStat) == -1) return 0;
+	for (int i = 0; i < sizeof(networkFileSystems) / sizeof(*networkFileSystems); i++) {
+		if ((fsStat.f_type & 0xFFFFFFFF) == networkFileSystems[i]) return 1;
+	}
+	return 0;
+}
+
+// Stats with blocking calls, spread across a handful of threads if that's likely to help.  Every stat on a network
+// file system is a round trip to the server so it's worth running them side by side.  On local file systems the
+// stat is cheap and threads would only add overhead.
+static void statBatchBlocking(StatJob * job) {
+	int threadCount = 0;
+	pthread_t threads[STAT_THREADS - 1];
+	if (job->count - job->next > 1 && isNetworkFileSystem(job->dirFd)) {
+		size_t wanted = job->count - job->next - 1;
+		while (threadCount < STAT_THREADS - 1 && threadCount < wanted
+				&& !pthread_create(&threads[threadCount], NULL, &statJobWorker, job)) {
+			threadCount++;
+		}
+	}
+	statJobWorker(job);
+	for (int i = 0; i < threadCount; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+void statBatch(int dirFd, const char * const * names, size_t count, struct stat * stats, int * errors, int flags,
+		unsigned int mask) {
+	size_t done = 0;
+	if (ring.fd != -1 && count > 1) {
+		struct statx statBuffers[URING_ENTRIES];
+		int results[URING_ENTRIES];
+		while (done < count) {
+			unsigned int batch = count - done < ring.sqEntries ? count - done : ring.sqEntries;
+			if (batch > URING_ENTRIES) batch = URING_ENTRIES;
+			for (unsigned int i = 0; i < batch; i++) {
+				struct io_uring_sqe * sqe = getSqe();
+				sqe->opcode = IORING_OP_STATX;
+				sqe->fd = dirFd;
+				sqe->addr = (uintptr_t) names[done + i];
+				sqe->len = mask;
+				sqe->addr2 = (uintptr_t) &statBuffers[i];
+				sqe->statx_flags = flags;
+				sqe->user_data = i;
+			}
+			if (!submitAndWait(results)) break;
+			for (unsigned int i = 0; i < batch; i++) {
+				if (results[i] < 0) {
+					errors[done + i] = -results[i];
+				} else {
+					errors[done + i] = 0;
+					statxToStat(&stats[done + i], &statBuffers[i]);
+				}
+			}
+			done += batch;
+		}
+	}
+
+	StatJob job = { .dirFd = dirFd, .names = names, .stats = stats, .errors = errors, .flags = flags, .mask = mask,
+			.count = count, .next = done };
+	statBatchBlocking(&job);
+}
+
+//////////////
+// End Stat //
+//////////////
+
+////////////
+// Unlink //
+////////////
+
+size_t unlinkBatch(int dirFd, const char * const * names, const int * flags, size_t count, int * errors) {
+	size_t done = 0;
+	size_t failures = 0;
+	if (ring.fd != -1 && count > 1) {
+		int results[URING_ENTRIES];
+		while (done < count) {
+			unsigned int batch = count - done < ring.sqEntries ? count - done : ring.sqEntries;
+			if (batch > URING_ENTRIES) batch = URING_ENTRIES;
+			for (unsigned int i = 0; i < batch; i++) {
+				struct io_uring_sqe * sqe = getSqe();
+				sqe->opcode = IORING_OP_UNLINKAT;
+				sqe->fd = dirFd;
+				sqe->addr = (uintptr_t) names[done + i];
+				sqe->unlink_flags = flags[done + i];
+				sqe->user_data = i;
+			}
+			if (!submitAndWait(results)) break;
+			for (unsigned int i = 0; i < batch; i++) {
+				errors[done + i] = -results[i];
+				if (results[i] < 0) failures++;
+			}
+			done += batch;
+		}
+	}
+
+	for (; done < count; done++) {
+		if (unlinkat(dirFd, names[done], flags[done]) == -1) {
+			errors[done] = errno;
+			failures++;
+		} else {
+			errors[done] = 0;
+		}
+	}
+	return failures;
+}
+
+////////////////
+// End Unlink //
+////////////////
+
+//////////
+// Copy //
+//////////
+
+static int copyFileDataSimple(int sourceFd, int targetFd, off_t offset) {
+	ssize_t bytesCopied;
+	do {
+		bytesCopied = copy_file_range(sourceFd, &offset, targetFd, &offset, 1 << 30, 0);
+	} while (bytesCopied > 0);
+	if (bytesCopied == 0) return 0;
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+
+	char buffer[BUFFER_SIZE];
+	ssize_t bytesRead;
+	while ((bytesRead = pread(sourceFd, buffer, sizeof(buffer), offset)) > 0) {
+		for (ssize_t bytesWritten = 0; bytesWritten < bytesRead;) {
+			ssize_t result = pwrite(targetFd, buffer + bytesWritten, bytesRead - bytesWritten,
+					offset + bytesWritten);
+			if (result == -1) return -1;
+			bytesWritten += result;
+		}
+		offset += bytesRead;
+	}
+	return bytesRead == 0 ? 0 : -1;
+}
+
+// Each chunk is queued as a read linked to a write of the same buffer at the same offset so the kernel runs the
+// whole window without returning to user space.  A short read (end of file) breaks the link, cancelling its write,
+// and the remainder is finished off with blocking calls.
+int copyFileData(int sourceFd, int targetFd) {
+	struct stat fileStat;
+	if (ring.fd == -1 || fstat(sourceFd, &fileStat) == -1 || fileStat.st_size <= COPY_CHUNK_SIZE) {
+		return copyFileDataSimple(sourceFd, targetFd, 0);
+	}
+
+	int results[COPY_CHUNKS * 2];
+	off_t offset = 0;
+	while (offset < fileStat.st_size) {
+		int chunks = (fileStat.st_size - offset + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+		if (chunks > COPY_CHUNKS) chunks = COPY_CHUNKS;
+		for (int i = 0; i < chunks; i++) {
+			struct io_uring_sqe * sqe = getSqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = sourceFd;
+			sqe->addr = (uintptr_t) (copyBuffers + i * COPY_CHUNK_SIZE);
+			sqe->len = COPY_CHUNK_SIZE;
+			sqe->off = offset + i * COPY_CHUNK_SIZE;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = i * 2;
+
+			sqe = getSqe();
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = targetFd;
+			sqe->addr = (uintptr_t) (copyBuffers + i * COPY_CHUNK_SIZE);
+			sqe->len = COPY_CHUNK_SIZE;
+			sqe->off = offset + i * COPY_CHUNK_SIZE;
+			sqe->user_data = i * 2 + 1;
+		}
+		if (!submitAndWait(results)) break;
+
+		for (int i = 0; i < chunks; i++) {
+			int bytesRead = results[i * 2];
+			int bytesWritten = results[i * 2 + 1];
+			if (bytesRead < 0) {
+				errno = -bytesRead;
+				return -1;
+			}
+			if (bytesWritten < 0 && bytesWritten != -ECANCELED) {
+				errno = -bytesWritten;
+				return -1;
+			}
+			if (bytesWritten < 0) bytesWritten = 0;
+			while (bytesWritten < bytesRead) {
+				ssize_t result = pwrite(targetFd, copyBuffers + i * COPY_CHUNK_SIZE + bytesWritten,
+						bytesRead - bytesWritten, offset + bytesWritten);
+				if (result == -1) return -1;
+				bytesWritten += result;
+			}
+			offset += bytesRead;
+			if (bytesRead < COPY_CHUNK_SIZE) {
+				// The file shrank while copying; anything written past here by later chunks is stale
+				if (ftruncate(targetFd, offset) == -1) return -1;
+				return copyFileDataSimple(sourceFd, targetFd, offset);
+			}
+		}
+	}
+
+	// Pick up anything appended since the file was stat'ed
+	return copyFileDataSimple(sourceFd, targetFd, offset);
+}
+
+//////////////
+// End Copy //
+//////////////
@@ -0,0 +1,27 @@
+#ifndef uring_h
+#define uring_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Sets up the io_uring used by the batch operations below. Returns 0 if io_uring is not available, in which case
+// every operation silently falls back to the equivalent blocking system calls.
+int initializeUring();
+
+// statx() every name relative to dirFd asking for the fields in mask (STATX_*).  flags are AT_* flags as accepted
+// by statx() eg: AT_SYMLINK_NOFOLLOW or AT_STATX_DONT_SYNC.  errors[i] is set to 0 on success or the errno of the
+// failed stat.
+void statBatch(int dirFd, const char * const * names, size_t count, struct stat * stats, int * errors, int flags,
+		unsigned int mask);
+
+// unlinkat() every name relative to dirFd with the matching flags (0 or AT_REMOVEDIR).
+// errors[i] is set to 0 on success or the errno of the failed unlink.  Returns the number of failures.
+size_t unlinkBatch(int dirFd, const char * const * names, const int * flags, size_t count, int * errors);
+
+// Is fd on a network (or FUSE) file system?  Other machines may change files there without inotify ever seeing it.
+int isNetworkFileSystem(int fd);
+
+// Copies the whole of sourceFd into targetFd.  Returns 0 on success or -1 with errno set.
+int copyFileData(int sourceFd, int targetFd);
+
+#endif
@@ -6,12 +6,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 #include <microhttpd.h>
+#include <poll.h>
 #include <pthread.h>
 #include <search.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -42,16 +47,24 @@ typedef struct Lock {
 typedef struct MHD_Connection Request;
 typedef struct MHD_Response Response;
 
+#define CREDENTIAL_DIGEST_SIZE 32
+#define SESSION_TOKEN_LENGTH 32
+#define CERTIFICATE_FINGERPRINT_LENGTH 64
+
 typedef struct RAP {
 	// Managed by create / destroy RAP
 	int pid;
 	int socketFd;
 	const char * user;
-	const char * password;
+	unsigned char passwordDigest[CREDENTIAL_DIGEST_SIZE];
 	const char * clientIp;
+	char sessionToken[SESSION_TOKEN_LENGTH + 1];
 
 	// Managed by RAP DB
 	time_t rapCreated;
+	time_t rapLastUsed;
+	int exited; // Set by the reaper thread (under rapRegistryLock) once the process has finished
+	struct RapList * list;
 	struct RAP * next;
 	struct RAP ** prevPtr;
 
@@ -63,6 +76,7 @@ typedef struct RAP {
 	Response * requestResponseObjectAlreadyGiven;
 	int requestLockCount;
 	Lock * requestLock[MAX_SESSION_LOCKS];
+	int requestIssueToken; // 0, SESSION_COOKIE or SESSION_COOKIE_SECURE
 
 } RAP;
 
@@ -70,6 +84,18 @@ typedef struct RapList {
 	RAP * firstRapSession;
 } RapList;
 
+typedef struct AuthFailure {
+	unsigned char key[CREDENTIAL_DIGEST_SIZE];
+	int failureCount;
+	time_t blockedUntil;
+	time_t expires;
+} AuthFailure;
+
+typedef struct RapUserCount {
+	const char * user;
+	int count;
+} RapUserCount;
+
 typedef struct Header {
 	const char * key;
 	const char * value;
@@ -118,14 +144,75 @@ static const RAP AUTH_ERROR_RAP = {
 		.next = NULL,
 		.prevPtr = NULL };
 
+// Used as a place holder for auth requests which could not be given a RAP because the server is at capacity
+static const RAP AUTH_BUSY_RAP = {
+		.pid = 0,
+		.socketFd = -1,
+		.user = "<server busy>",
+		.requestWriteDataFd = -1,
+		.requestReadDataFd = -1,
+		.requestResponseAlreadyGiven = 503,
+		.requestLockCount = 0,
+		.next = NULL,
+		.prevPtr = NULL };
+
 static pthread_key_t rapDBThreadKey;
 static sem_t rapPoolLock;
 static RapList rapPool;
 
+// Counts of every live RAP (in the pool or in use by a thread).  Always lock rapPoolLock before this if both
+// are needed.
+static sem_t rapRegistryLock;
+static int rapCount = 0;
+static void * rapUserCounts = NULL;
+static void * rapProcesses = NULL;
+static void * rapSessionTokens = NULL;
+
+// RAP processes are watched through pidfds registered here.  -1 if pidfds are not supported.
+static int reaperEpollFd = -1;
+
 #define AUTH_FAILED ( ( RAP *) &AUTH_FAILED_RAP )
 #define AUTH_ERROR ( ( RAP *) &AUTH_ERROR_RAP )
+#define AUTH_BUSY ( ( RAP *) &AUTH_BUSY_RAP )
+
+#define AUTH_SUCCESS(rap) (rap != AUTH_FAILED && rap != AUTH_ERROR && rap != AUTH_BUSY)
 
-#define AUTH_SUCCESS(rap) (rap != AUTH_FAILED && rap != AUTH_ERROR)
+// Spare RAPs are started in advance so that a login only has to wait for PAM, not for fork() and exec().
+typedef struct SpareRap {
+	int pid;
+	int socketFd;
+} SpareRap;
+
+static sem_t spareRapLock;
+static sem_t spareRapWanted;
+static SpareRap * spareRaps;
+static int spareRapCount = 0;
+
+// Limits the number of RAPs waiting on PAM at once so that a slow PAM backend can't tie up every worker.
+static sem_t authSlots;
+
+// Failed logins are remembered by a salted digest so that neither passwords nor user names are held in memory.
+// Each entry is one of these kinds.
+#define AUTH_FAILURE_CREDENTIALS 'c'
+#define AUTH_FAILURE_IP 'i'
+#define AUTH_FAILURE_USER 'u'
+#define RAP_PASSWORD_DIGEST 'p'
+#define RAP_CERTIFICATE_DIGEST 'f'
+
+// Once authenticated clients are given a cookie which finds their RAP without Basic auth.
+#define SESSION_COOKIE_NAME "WebdavdSession"
+#define SESSION_COOKIE 1
+#define SESSION_COOKIE_SECURE 2
+
+static unsigned char credentialSalt[CREDENTIAL_DIGEST_SIZE];
+static sem_t authFailureLock;
+static void * authFailures = NULL;
+static time_t authFailureExpiryTime;
+static int authFailureReadyForReleaseCount;
+static AuthFailure ** authFailureReadyForRelease;
+
+// Fire when tasks have stalled for 150ms waiting on memory within any 2 second window.
+#define MEMORY_PRESSURE_TRIGGER "some 150000 2000000"
 
 static time_t lockExpiryTime;
 static int lockReadyForReleaseCount;
@@ -134,11 +221,12 @@ static Lock ** readyForRelease;
 // TODO create shutdown routine
 static int shuttingDown = 0;
 
-#define ACCEPT_HEADER "OPTIONS, GET, HEAD, DELETE, PROPFIND, PUT, PROPPATCH, COPY, MOVE, LOCK, UNLOCK"
+#define ACCEPT_HEADER "OPTIONS, GET, HEAD, DELETE, PROPFIND, PUT, PROPPATCH, COPY, MOVE, LOCK, UNLOCK, REPORT"
 
 static Response * INTERNAL_SERVER_ERROR_PAGE;
 static Response * UNAUTHORIZED_PAGE;
 static Response * METHOD_NOT_SUPPORTED_PAGE;
+static Response * SERVICE_UNAVAILABLE_PAGE;
 static Response * NO_CONTENT_PAGE;
 
 static const char * FORBIDDEN_PAGE;
@@ -300,6 +388,11 @@ static int requestHasData(Request *request) {
 	}
 }
 
+static int requestExpectsContinue(Request *request) {
+	const char * expect = getHeader(request, "Expect");
+	return expect && !strcasecmp(expect, "100-continue");
+}
+
 static void parseHeaderFilePath(char * resultBuffer, size_t urlLength, const char * url) {
 	if (url[0] != '/') {
 		// Find the start of the path (after the http://domain.tld/)
@@ -353,11 +446,28 @@ static void parseHeaderFilePath(char * resultBuffer, size_t urlLength, const cha
 // RAP Processing //
 ////////////////////
 
-static time_t getExpiryTime() {
-	time_t expires;
-	time(&expires);
-	expires -= config.rapMaxSessionLife;
-	return expires;
+// A RAP expires once it has been idle for the session timeout or has reached its maximum life.
+static int rapExpired(RAP * rapSession, time_t now) {
+	return rapSession->rapCreated < now - config.rapMaxSessionLife
+			|| rapSession->rapLastUsed < now - config.rapSessionTimeout;
+}
+
+// Registers a newly forked RAP with the reaper thread.  The child can not be reaped (and its pid re-used) until
+// the reaper has seen it exit.
+static void watchRapProcess(int pid) {
+	if (reaperEpollFd == -1) {
+		return;
+	}
+	int pidFd = pidfd_open(pid, 0);
+	if (pidFd == -1) {
+		stdLogError(errno, "Could not open pidfd for RAP %d", pid);
+		return;
+	}
+	struct epoll_event event = { .events = EPOLLIN, .data.u64 = ((uint64_t) pidFd << 32) | (uint32_t) pid };
+	if (epoll_ctl(reaperEpollFd, EPOLL_CTL_ADD, pidFd, &event) == -1) {
+		stdLogError(errno, "Could not watch RAP %d", pid);
+		close(pidFd);
+	}
 }
 
 static int forkRapProcess(const char * path, int * newSockFd) {
@@ -369,29 +479,46 @@ static int forkRapProcess(const char * path, int * newSockFd) {
 		return 0;
 	}
 
-	// We set this timeout so that a hung RAP will eventually clean itself up
+	// We set these timeouts so that a hung RAP will eventually clean itself up
 	struct timeval timeout;
 	timeout.tv_sec = config.rapTimeoutRead;
 	timeout.tv_usec = 0;
-	if (setsockopt(sockFd[PARENT_SOCKET], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+	if (setsockopt(sockFd[PARENT_SOCKET], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0
+			|| setsockopt(sockFd[PARENT_SOCKET], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
 		stdLogError(errno, "Could not set timeout");
 		close(sockFd[PARENT_SOCKET]);
 		close(sockFd[CHILD_SOCKET]);
 		return 0;
 	}
 
+	// The child's fds in order: RAP_CONTROL_SOCKET, RAP_RING_FD, RAP_RING_REQUEST_EVENT_FD, RAP_RING_RESPONSE_EVENT_FD
+	int childFds[4] = { sockFd[CHILD_SOCKET], -1, -1, -1 };
+	int childFdCount = 1;
+	if (config.rapSharedMemory) {
+		if (!createRingTransport(sockFd[PARENT_SOCKET], &childFds[1], &childFds[2], &childFds[3])) {
+			close(sockFd[PARENT_SOCKET]);
+			close(sockFd[CHILD_SOCKET]);
+			return 0;
+		}
+		childFdCount = 4;
+	}
+
 	result = fork();
 	if (result) {
 
 		// parent
 		close(sockFd[CHILD_SOCKET]);
+		if (childFds[1] != -1) {
+			close(childFds[1]);
+		}
 		if (result != -1) {
+			watchRapProcess(result);
 			*newSockFd = sockFd[PARENT_SOCKET];
 			//stdLog("New RAP %d on %d", result, sockFd[0]);
 			return result;
 		} else {
 			// fork failed so close parent pipes and return non-zero
-			close(sockFd[PARENT_SOCKET]);
+			closeMessageSocket(sockFd[PARENT_SOCKET]);
 			stdLogError(errno, "Could not fork");
 			return 0;
 		}
@@ -399,22 +526,23 @@ static int forkRapProcess(const char * path, int * newSockFd) {
 
 		// child
 		close(sockFd[PARENT_SOCKET]);
-		if (sockFd[CHILD_SOCKET] == RAP_CONTROL_SOCKET) {
-			// If by some chance this socket has opened as pre-defined RAP_CONTROL_SOCKET we
-			// won't dup2 but we do need to remove the close-on-exec flag
-			int flags = fcntl(sockFd[CHILD_SOCKET], F_GETFD);
-			if (fcntl(sockFd[CHILD_SOCKET], F_SETFD, flags & ~FD_CLOEXEC) == -1) {
-				stdLogError(errno, "Could not clear close-on-exec for control socket", sockFd[CHILD_SOCKET],
-						(int) RAP_CONTROL_SOCKET);
-				exit(255);
-			}
-		} else {
-			// Assign the control socket to the correct FD so the RAP can use it
-			// This previously abused STD_IN and STD_OUT for this but instead we now
-			// reserve a different FD (3) AKA RAP_CONTROL_SOCKET
-			if (dup2(sockFd[CHILD_SOCKET], RAP_CONTROL_SOCKET) == -1) {
-				stdLogError(errno, "Could not assign new socket (%d) to %d", sockFd[CHILD_SOCKET],
-						(int) RAP_CONTROL_SOCKET);
+
+		// The signal mask survives execv so undo the one set by initializeRapDatabase()
+		sigset_t childSignals;
+		sigemptyset(&childSignals);
+		sigaddset(&childSignals, SIGCHLD);
+		pthread_sigmask(SIG_UNBLOCK, &childSignals, NULL);
+
+		// Assign the control socket (and shared memory) to the correct FDs so the RAP can use them
+		// This previously abused STD_IN and STD_OUT for this but instead we now
+		// reserve a different FD (3) AKA RAP_CONTROL_SOCKET.  Each is first moved out of the way so that
+		// none can be overwritten by another's dup2.  dup2 clears close-on-exec on the new FD.
+		for (int i = 0; i < childFdCount; i++) {
+			childFds[i] = fcntl(childFds[i], F_DUPFD_CLOEXEC, RAP_CONTROL_SOCKET + 10);
+		}
+		for (int i = 0; i < childFdCount; i++) {
+			if (childFds[i] == -1 || dup2(childFds[i], RAP_CONTROL_SOCKET + i) == -1) {
+				stdLogError(errno, "Could not assign new socket (%d) to %d", childFds[i], RAP_CONTROL_SOCKET + i);
 				exit(255);
 			}
 		}
@@ -440,16 +568,163 @@ static void addRapToList(RapList * list, RAP * rapSession) {
 	rapSession->next = list->firstRapSession;
 	list->firstRapSession = rapSession;
 	rapSession->prevPtr = &list->firstRapSession;
+	rapSession->list = list;
 	if (rapSession->next) {
 		rapSession->next->prevPtr = &rapSession->next;
 	}
 }
 
+static int compareRapUserCount(const void * a, const void * b) {
+	return strcmp(((const RapUserCount *) a)->user, ((const RapUserCount *) b)->user);
+}
+
+static int compareRapPid(const void * a, const void * b) {
+	return ((const RAP *) a)->pid - ((const RAP *) b)->pid;
+}
+
+static int compareRapSessionToken(const void * a, const void * b) {
+	return strcmp(((const RAP *) a)->sessionToken, ((const RAP *) b)->sessionToken);
+}
+
+// Registers the RAP's pid so the reaper can mark it exited.  This is done before the RAP is sent anything so that
+// its death is noticed however early it comes.
+static void registerRapProcess(RAP * rapSession) {
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while registering rap");
+		return;
+	}
+	RAP ** found = tsearch(rapSession, &rapProcesses, &compareRapPid);
+	if (found && *found != rapSession) {
+		// Registered RAPs are only removed once reaped so the pid can only have been re-used if this RAP (a spare
+		// not yet registered) has already died and been reaped
+		rapSession->exited = 1;
+	}
+	sem_post(&rapRegistryLock);
+}
+
+static void registerRapSessionToken(RAP * rapSession) {
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while registering rap");
+		return;
+	}
+	if (rapSession->sessionToken[0]) {
+		tsearch(rapSession, &rapSessionTokens, &compareRapSessionToken);
+	}
+	sem_post(&rapRegistryLock);
+}
+
+// The reaper marks RAPs exited from its own thread
+static int rapExited(RAP * rapSession) {
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while checking rap");
+		return 0;
+	}
+	int exited = rapSession->exited;
+	sem_post(&rapRegistryLock);
+	return exited;
+}
+
+static void unregisterRapProcess(RAP * rapSession) {
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while unregistering rap");
+		return;
+	}
+	if (rapSession->sessionToken[0]) {
+		tdelete(rapSession, &rapSessionTokens, &compareRapSessionToken);
+	}
+	if (!rapSession->exited) {
+		RAP ** found = tfind(rapSession, &rapProcesses, &compareRapPid);
+		if (found && *found == rapSession) {
+			tdelete(rapSession, &rapProcesses, &compareRapPid);
+		}
+	}
+	sem_post(&rapRegistryLock);
+}
+
+static void releaseRapSlot(const char * user) {
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while releasing rap");
+		return;
+	}
+	rapCount--;
+	RapUserCount toFind = { .user = user };
+	RapUserCount ** found = tfind(&toFind, &rapUserCounts, &compareRapUserCount);
+	if (found) {
+		RapUserCount * userCount = *found;
+		userCount->count--;
+		if (userCount->count == 0) {
+			tdelete(userCount, &rapUserCounts, &compareRapUserCount);
+			freeSafe(userCount);
+		}
+	}
+	sem_post(&rapRegistryLock);
+}
+
+// Finds the least recently used RAP in the pool (optionally for a specific user).  Only pooled RAPs are
+// considered as any RAP in a thread's own list belongs to an open connection.
+// Must be called with rapPoolLock held.
+static RAP * findLeastRecentlyUsedRap(const char * user) {
+	RAP * found = NULL;
+	for (RAP * rap = rapPool.firstRapSession; rap; rap = rap->next) {
+		if ((!user || !strcmp(user, rap->user)) && (!found || rap->rapLastUsed < found->rapLastUsed)) {
+			found = rap;
+		}
+	}
+	return found;
+}
+
+static void destroyRap(RAP * rapSession);
+
+// Reserves space for a new RAP for the given user.  If the server is at capacity idle RAPs are evicted from
+// the pool to make room.  Returns 0 if no space could be made.
+static int reserveRapSlot(const char * user) {
+	if (sem_wait(&rapPoolLock) == -1) {
+		stdLogError(errno, "Could not wait for rap pool lock while reserving rap");
+		return 0;
+	}
+	int reserved = 0;
+	while (1) {
+		if (sem_wait(&rapRegistryLock) == -1) {
+			stdLogError(errno, "Could not wait for rap registry lock while reserving rap");
+			break;
+		}
+		RapUserCount toFind = { .user = user };
+		RapUserCount ** found = tfind(&toFind, &rapUserCounts, &compareRapUserCount);
+		int userFull = config.rapMaxUserSessions && found && (*found)->count >= config.rapMaxUserSessions;
+		int serverFull = config.rapMaxSessions && rapCount >= config.rapMaxSessions;
+		if (!userFull && !serverFull) {
+			if (!found) {
+				size_t userSize = strlen(user) + 1;
+				RapUserCount * userCount = mallocSafe(sizeof(*userCount) + userSize);
+				userCount->user = (const char *) (userCount + 1);
+				memcpy((char *) userCount->user, user, userSize);
+				userCount->count = 0;
+				found = tsearch(userCount, &rapUserCounts, &compareRapUserCount);
+			}
+			(*found)->count++;
+			rapCount++;
+			reserved = 1;
+		}
+		sem_post(&rapRegistryLock);
+		if (reserved) break;
+
+		RAP * victim = findLeastRecentlyUsedRap(userFull ? user : NULL);
+		if (!victim) {
+			stdLogError(0, "Could not create rap for %s: %s session limit reached", user,
+					userFull ? "user" : "server");
+			break;
+		}
+		destroyRap(victim);
+	}
+	sem_post(&rapPoolLock);
+	return reserved;
+}
+
 static void destroyRap(RAP * rapSession) {
 	if (!AUTH_SUCCESS(rapSession)) {
 		return;
 	}
-	close(rapSession->socketFd);
+	closeMessageSocket(rapSession->socketFd);
 	if (rapSession->requestReadDataFd != -1) {
 		stdLogError(0, "readDataFd was not properly closed before destroying rap");
 		close(rapSession->requestReadDataFd);
@@ -459,38 +734,186 @@ static void destroyRap(RAP * rapSession) {
 		close(rapSession->requestWriteDataFd);
 	}
 
+	unregisterRapProcess(rapSession);
+	releaseRapSlot(rapSession->user);
 	freeSafe((void *) rapSession->user);
-	freeSafe((void *) rapSession->password);
 	freeSafe((void *) rapSession->clientIp);
 	removeRapFromList(rapSession);
 	freeSafe(rapSession);
 }
 
-static RAP * createRap(RapList * db, const char * user, const char * password, const char * rhost) {
+static void credentialDigest(unsigned char * digest, char kind, const char * user, const char * password,
+		const char * clientIp) {
+	const char * parts[] = { user, password, clientIp };
+	size_t partSizes[3];
+	size_t size = sizeof(credentialSalt) + 1;
+	for (int i = 0; i < 3; i++) {
+		partSizes[i] = parts[i] ? strlen(parts[i]) + 1 : 0;
+		size += partSizes[i];
+	}
+	unsigned char * buffer = mallocSafe(size);
+	unsigned char * position = buffer;
+	memcpy(position, credentialSalt, sizeof(credentialSalt));
+	position += sizeof(credentialSalt);
+	*(position++) = kind;
+	for (int i = 0; i < 3; i++) {
+		if (parts[i]) {
+			memcpy(position, parts[i], partSizes[i]);
+			position += partSizes[i];
+		}
+	}
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, buffer, size, digest);
+	memset(buffer, 0, size);
+	freeSafe(buffer);
+}
+
+static int setRapReadTimeout(int socketFd, time_t seconds) {
+	struct timeval timeout = { .tv_sec = seconds, .tv_usec = 0 };
+	if (setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		stdLogError(errno, "Could not set timeout");
+		return 0;
+	}
+	return 1;
+}
+
+// Takes a ready started RAP from the spare pool, or starts one if there are none.  Returns 0 on failure.
+static int takeSpareRap(int * socketFd) {
+	int pid = 0;
+	if (sem_wait(&spareRapLock) == -1) {
+		stdLogError(errno, "Could not wait for spare rap lock");
+	} else {
+		if (spareRapCount > 0) {
+			spareRapCount--;
+			pid = spareRaps[spareRapCount].pid;
+			*socketFd = spareRaps[spareRapCount].socketFd;
+			sem_post(&spareRapWanted);
+		}
+		sem_post(&spareRapLock);
+	}
+	if (!pid) {
+		pid = forkRapProcess(config.rapBinary, socketFd);
+	}
+	return pid;
+}
+
+static void * spareRapFiller(void * ignored) {
+	while (!shuttingDown) {
+		if (sem_wait(&spareRapWanted) == -1) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait for spare rap request");
+			return NULL;
+		}
+		if (sem_wait(&spareRapLock) == -1) {
+			stdLogError(errno, "Could not wait for spare rap lock");
+			return NULL;
+		}
+		int full = spareRapCount >= config.authWorkers;
+		sem_post(&spareRapLock);
+		if (full) continue;
+
+		SpareRap spare;
+		spare.pid = forkRapProcess(config.rapBinary, &spare.socketFd);
+		if (!spare.pid) {
+			// Don't spin if the system can't fork, the next login will try again.
+			continue;
+		}
+		if (sem_wait(&spareRapLock) == -1) {
+			stdLogError(errno, "Could not wait for spare rap lock");
+			closeMessageSocket(spare.socketFd);
+			return NULL;
+		}
+		spareRaps[spareRapCount++] = spare;
+		sem_post(&spareRapLock);
+	}
+	return NULL;
+}
+
+// Waits for one of the limited number of concurrent authentication slots.  Returns 0 if none became free
+// within the auth timeout.
+static int acquireAuthSlot() {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += config.authTimeout;
+	while (sem_timedwait(&authSlots, &deadline) == -1) {
+		if (errno != EINTR) {
+			if (errno != ETIMEDOUT) {
+				stdLogError(errno, "Could not wait for auth slot");
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void generateSessionToken(char * token) {
+	unsigned char random[SESSION_TOKEN_LENGTH / 2];
+	if (gnutls_rnd(GNUTLS_RND_KEY, random, sizeof(random))) {
+		stdLogError(0, "Could not generate session token");
+		token[0] = '\0';
+		return;
+	}
+	for (int i = 0; i < sizeof(random); i++) {
+		sprintf(token + i * 2, "%02x", random[i]);
+	}
+}
+
+// Starts a new RAP for the user.  If password is NULL the user has already been identified by a client certificate
+// and the RAP is asked to skip the password check.
+static RAP * createRap(RapList * db, const char * user, const char * password,
+		const unsigned char * passwordDigest, const char * rhost) {
+	if (!reserveRapSlot(user)) {
+		return AUTH_BUSY;
+	}
+
+	if (!acquireAuthSlot()) {
+		stdLogError(0, "Could not authenticate %s: timed out waiting for other logins", user);
+		releaseRapSlot(user);
+		return AUTH_BUSY;
+	}
+
 	int socketFd;
-	int pid = forkRapProcess(config.rapBinary, &socketFd);
+	int pid = takeSpareRap(&socketFd);
 	if (!pid) {
+		sem_post(&authSlots);
+		releaseRapSlot(user);
 		return AUTH_ERROR;
 	}
+	RAP * newRap = mallocSafe(sizeof(*newRap));
+	newRap->pid = pid;
+	newRap->socketFd = socketFd;
+	newRap->sessionToken[0] = '\0';
+	newRap->exited = 0;
+	registerRapProcess(newRap);
 
 	// Send Auth Request
 	Message message;
-	message.mID = RAP_REQUEST_AUTHENTICATE;
+	message.mID = password ? RAP_REQUEST_AUTHENTICATE : RAP_REQUEST_AUTHENTICATE_CERTIFICATE;
 	message.fd = -1;
 	message.paramCount = 3;
 	message.params[RAP_PARAM_AUTH_USER] = stringToMessageParam(user);
 	message.params[RAP_PARAM_AUTH_PASSWORD] = stringToMessageParam(password);
 	message.params[RAP_PARAM_AUTH_RHOST] = stringToMessageParam(rhost);
-	if (sendMessage(socketFd, &message) <= 0) {
-		close(socketFd);
+	if (!setRapReadTimeout(socketFd, config.authTimeout) || sendMessage(socketFd, &message) <= 0) {
+		closeMessageSocket(socketFd);
+		sem_post(&authSlots);
+		unregisterRapProcess(newRap);
+		freeSafe(newRap);
+		releaseRapSlot(user);
 		return AUTH_ERROR;
 	}
 
 	// Read Auth Result
 	char incomingBuffer[INCOMING_BUFFER_SIZE];
 	ssize_t readResult = recvMessage(socketFd, &message, incomingBuffer, INCOMING_BUFFER_SIZE);
+	sem_post(&authSlots);
+	if (readResult > 0 && message.mID == RAP_RESPOND_OK && !setRapReadTimeout(socketFd, config.rapTimeoutRead)) {
+		readResult = -1;
+	}
 	if (readResult <= 0 || message.mID != RAP_RESPOND_OK) {
-		close(socketFd);
+		closeMessageSocket(socketFd);
+		unregisterRapProcess(newRap);
+		freeSafe(newRap);
+		releaseRapSlot(user);
 		if (readResult < 0) {
 			stdLogError(0, "Could not read result from RAP ");
 			return AUTH_ERROR;
@@ -504,42 +927,237 @@ static RAP * createRap(RapList * db, const char * user, const char * password, c
 	}
 
 	// If successfully authenticated then populate the RAP structure and add it to the DB
-	RAP * newRap = mallocSafe(sizeof(*newRap));
-	newRap->pid = pid;
-	newRap->socketFd = socketFd;
 	newRap->user = copyString(user);
-	newRap->password = copyString(password);
+	memcpy(newRap->passwordDigest, passwordDigest, CREDENTIAL_DIGEST_SIZE);
+	generateSessionToken(newRap->sessionToken);
 	newRap->clientIp = copyString(rhost);
 	time(&newRap->rapCreated);
+	newRap->rapLastUsed = newRap->rapCreated;
 	newRap->requestWriteDataFd = -1;
 	newRap->requestReadDataFd = -1;
+	registerRapSessionToken(newRap);
 	addRapToList(db, newRap);
 	// newRap->responseAlreadyGiven // this is set elsewhere
 	return newRap;
 }
 
-// void releaseRap(RAP * processor) {}
+static int compareAuthFailure(const void * a, const void * b) {
+	return memcmp(((const AuthFailure *) a)->key, ((const AuthFailure *) b)->key, CREDENTIAL_DIGEST_SIZE);
+}
+
+// Must be called with authFailureLock held.
+static AuthFailure * findAuthFailure(char kind, const char * user, const char * password, const char * clientIp,
+		int create) {
+	AuthFailure toFind;
+	credentialDigest(toFind.key, kind, user, password, clientIp);
+	AuthFailure ** found = tfind(&toFind, &authFailures, &compareAuthFailure);
+	if (found) {
+		return *found;
+	} else if (create) {
+		AuthFailure * newFailure = mallocSafe(sizeof(*newFailure));
+		memcpy(newFailure->key, toFind.key, CREDENTIAL_DIGEST_SIZE);
+		newFailure->failureCount = 0;
+		newFailure->blockedUntil = 0;
+		newFailure->expires = 0;
+		tsearch(newFailure, &authFailures, &compareAuthFailure);
+		return newFailure;
+	} else {
+		return NULL;
+	}
+}
+
+static void removeAuthFailure(AuthFailure * failure) {
+	tdelete(failure, &authFailures, &compareAuthFailure);
+	freeSafe(failure);
+}
+
+// Returns true if these credentials have recently failed, or the user or client ip is currently backing off.
+static int authFailureBlocked(const char * user, const char * password, const char * clientIp) {
+	if (sem_wait(&authFailureLock) == -1) {
+		stdLogError(errno, "Could not wait for auth failure lock");
+		return 0;
+	}
+	time_t now;
+	time(&now);
+	AuthFailure * failure = findAuthFailure(AUTH_FAILURE_CREDENTIALS, user, password, clientIp, 0);
+	int blocked = failure && failure->expires > now;
+	if (!blocked) {
+		failure = findAuthFailure(AUTH_FAILURE_IP, NULL, NULL, clientIp, 0);
+		blocked = failure && failure->blockedUntil > now;
+	}
+	if (!blocked) {
+		failure = findAuthFailure(AUTH_FAILURE_USER, user, NULL, NULL, 0);
+		blocked = failure && failure->blockedUntil > now;
+	}
+	sem_post(&authFailureLock);
+	return blocked;
+}
+
+static void backOffAuthFailure(AuthFailure * failure, time_t now) {
+	if (failure->failureCount < 30) {
+		failure->failureCount++;
+	}
+	time_t backoff = (time_t) 1 << (failure->failureCount - 1);
+	if (backoff > config.authMaxBackoff) {
+		backoff = config.authMaxBackoff;
+	}
+	failure->blockedUntil = now + backoff;
+	failure->expires = failure->blockedUntil + config.authFailureCacheTime;
+}
+
+static void recordAuthFailure(const char * user, const char * password, const char * clientIp) {
+	if (sem_wait(&authFailureLock) == -1) {
+		stdLogError(errno, "Could not wait for auth failure lock");
+		return;
+	}
+	time_t now;
+	time(&now);
+	AuthFailure * failure = findAuthFailure(AUTH_FAILURE_CREDENTIALS, user, password, clientIp, 1);
+	failure->expires = now + config.authFailureCacheTime;
+	backOffAuthFailure(findAuthFailure(AUTH_FAILURE_IP, NULL, NULL, clientIp, 1), now);
+	backOffAuthFailure(findAuthFailure(AUTH_FAILURE_USER, user, NULL, NULL, 1), now);
+	sem_post(&authFailureLock);
+}
+
+static void recordAuthSuccess(const char * user, const char * clientIp) {
+	if (sem_wait(&authFailureLock) == -1) {
+		stdLogError(errno, "Could not wait for auth failure lock");
+		return;
+	}
+	AuthFailure * failure = findAuthFailure(AUTH_FAILURE_IP, NULL, NULL, clientIp, 0);
+	if (failure) removeAuthFailure(failure);
+	failure = findAuthFailure(AUTH_FAILURE_USER, user, NULL, NULL, 0);
+	if (failure) removeAuthFailure(failure);
+	sem_post(&authFailureLock);
+}
+
+static void cleanAuthFailureAction(const void *nodep, const VISIT which, const int depth) {
+	switch (which) {
+	case postorder:
+	case leaf: {
+		AuthFailure * failure = *((AuthFailure **) nodep);
+		if (failure->expires < authFailureExpiryTime) {
+			int index = authFailureReadyForReleaseCount++;
+			if (!(index & 0xF)) {
+				authFailureReadyForRelease = reallocSafe(authFailureReadyForRelease,
+						(index + 0x10) * sizeof(*authFailureReadyForRelease));
+			}
+			authFailureReadyForRelease[index] = failure;
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+static void runCleanAuthFailures() {
+	if (sem_wait(&authFailureLock) == -1) {
+		stdLogError(errno, "Could not wait for auth failure lock");
+	} else {
+		if (authFailures) {
+			time(&authFailureExpiryTime);
+			authFailureReadyForReleaseCount = 0;
+			authFailureReadyForRelease = NULL;
+			twalk(authFailures, &cleanAuthFailureAction);
+
+			if (authFailureReadyForReleaseCount > 0) {
+				for (int i = 0; i < authFailureReadyForReleaseCount; i++) {
+					removeAuthFailure(authFailureReadyForRelease[i]);
+				}
+				freeSafe(authFailureReadyForRelease);
+			}
+		}
+		sem_post(&authFailureLock);
+	}
+}
+
+static RapList * getThreadRapList() {
+	RapList * threadRapList = pthread_getspecific(rapDBThreadKey);
+	if (!threadRapList) {
+		threadRapList = mallocSafe(sizeof(*threadRapList));
+		memset(threadRapList, 0, sizeof(*threadRapList));
+		pthread_setspecific(rapDBThreadKey, threadRapList);
+	}
+	return threadRapList;
+}
+
+// Finds the RAP issued with the given session token.  The token is only accepted from the client ip it was
+// issued to and only if the RAP is not already busy with a request on another connection.
+// Returns NULL if the token is not usable, in which case the client must authenticate again.
+static RAP * acquireRapByToken(const char * token, const char * clientIp) {
+	if (!token || strlen(token) != SESSION_TOKEN_LENGTH) {
+		return NULL;
+	}
+	RapList * threadRapList = getThreadRapList();
+	time_t now;
+	time(&now);
+
+	if (sem_wait(&rapPoolLock) == -1) {
+		stdLogError(errno, "Could not wait for rap pool lock while acquiring rap");
+		return NULL;
+	}
+	if (sem_wait(&rapRegistryLock) == -1) {
+		stdLogError(errno, "Could not wait for rap registry lock while acquiring rap");
+		sem_post(&rapPoolLock);
+		return NULL;
+	}
+	RAP toFind;
+	strcpy(toFind.sessionToken, token);
+	RAP ** found = tfind(&toFind, &rapSessionTokens, &compareRapSessionToken);
+	RAP * rap = found ? *found : NULL;
+	if (rap && (strcmp(clientIp, rap->clientIp) || (rap->list != threadRapList && rap->list != &rapPool))) {
+		rap = NULL;
+	}
+	int exited = rap && rap->exited;
+	sem_post(&rapRegistryLock);
+
+	if (rap) {
+		if (exited || rapExpired(rap, now)) {
+			destroyRap(rap);
+			rap = NULL;
+		} else {
+			if (rap->list == &rapPool) {
+				removeRapFromList(rap);
+				addRapToList(threadRapList, rap);
+			}
+			rap->rapLastUsed = now;
+		}
+	}
+	sem_post(&rapPoolLock);
+	return rap;
+}
 
-static RAP * acquireRap(const char * user, const char * password, const char * clientIp) {
-	if (user && password) {
+// Finds or creates a RAP for the user.  The user is identified either by password or (if password is NULL) by the
+// fingerprint of a client certificate which has already been verified.
+static RAP * acquireRap(const char * user, const char * password, const char * certificate,
+		const char * clientIp) {
+	if (user && (password || certificate)) {
 		RAP * rap;
-		time_t expires = getExpiryTime();
+		time_t now;
+		time(&now);
+		unsigned char passwordDigest[CREDENTIAL_DIGEST_SIZE];
+		if (password) {
+			credentialDigest(passwordDigest, RAP_PASSWORD_DIGEST, user, password, NULL);
+		} else {
+			credentialDigest(passwordDigest, RAP_CERTIFICATE_DIGEST, user, certificate, NULL);
+		}
 		RapList * threadRapList = pthread_getspecific(rapDBThreadKey);
 		if (!threadRapList) {
-			threadRapList = mallocSafe(sizeof(*threadRapList));
-			memset(threadRapList, 0, sizeof(*threadRapList));
-			pthread_setspecific(rapDBThreadKey, threadRapList);
+			threadRapList = getThreadRapList();
 		} else {
 			// Get a rap from this thread's own list
 			rap = threadRapList->firstRapSession;
 			while (rap) {
-				if (rap->rapCreated < expires) {
+				if (rapExited(rap) || rapExpired(rap, now)) {
 					RAP * raptmp = rap->next;
 					destroyRap(rap);
 					rap = raptmp;
-				} else if (!strcmp(user, rap->user)
-						&& !strcmp(password, rap->password) /*&& !strcmp(clientIp, rap->clientIp)*/) {
+				} else if (!strcmp(user, rap->user) && !memcmp(passwordDigest, rap->passwordDigest,
+						CREDENTIAL_DIGEST_SIZE) /*&& !strcmp(clientIp, rap->clientIp)*/) {
 					// all requests here will come from the same ip so we don't check it in the above.
+					rap->rapLastUsed = now;
 					return rap;
 				} else {
 					rap = rap->next;
@@ -553,16 +1171,18 @@ static RAP * acquireRap(const char * user, const char * password, const char * c
 		} else {
 			rap = rapPool.firstRapSession;
 			while (rap) {
-				if (rap->rapCreated < expires) {
+				if (rapExited(rap) || rapExpired(rap, now)) {
 					RAP * raptmp = rap->next;
 					destroyRap(rap);
 					rap = raptmp;
-				} else if (!strcmp(user, rap->user) && !strcmp(password, rap->password)
+				} else if (!strcmp(user, rap->user)
+						&& !memcmp(passwordDigest, rap->passwordDigest, CREDENTIAL_DIGEST_SIZE)
 						&& !strcmp(clientIp, rap->clientIp)) {
 					// We will only re-use sessions in the pool if they are from the same ip
 					removeRapFromList(rap);
 					addRapToList(threadRapList, rap);
 					sem_post(&rapPoolLock);
+					rap->rapLastUsed = now;
 					return rap;
 				} else {
 					rap = rap->next;
@@ -570,22 +1190,69 @@ static RAP * acquireRap(const char * user, const char * password, const char * c
 			}
 			sem_post(&rapPoolLock);
 		}
-		return createRap(threadRapList, user, password, clientIp);
+
+		// Don't bother PAM with credentials that are known to be bad or while the client is backing off
+		if (authFailureBlocked(user, password ? password : certificate, clientIp)) {
+			stdLogError(0, "Access denied for user %s (recent failure)", user);
+			return AUTH_FAILED;
+		}
+		rap = createRap(threadRapList, user, password, passwordDigest, clientIp);
+		if (rap == AUTH_FAILED) {
+			recordAuthFailure(user, password ? password : certificate, clientIp);
+		} else if (AUTH_SUCCESS(rap)) {
+			recordAuthSuccess(user, clientIp);
+		}
+		return rap;
 	} else {
 		stdLogError(0, "Rejecting request without auth");
 		return AUTH_FAILED;
 	}
 }
 
-#define releaseRap(processor)
+// Marks the end of a request.  Long running requests (large uploads and downloads) count as activity so
+// the idle time is measured from when the request finished not when it started.
+static void releaseRap(RAP * rapSession) {
+	time(&rapSession->rapLastUsed);
+}
 
-static void cleanupAfterRap(int sig, siginfo_t *siginfo, void *context) {
-	int status;
-	waitpid(siginfo->si_pid, &status, 0);
-	if (status == 139) {
-		stdLogError(0, "RAP %d failed with segmentation fault", siginfo->si_pid);
+static void * rapReaper(void * ignored) {
+	struct epoll_event events[16];
+	while (1) {
+		int eventCount = epoll_wait(reaperEpollFd, events, sizeof(events) / sizeof(*events), -1);
+		if (eventCount == -1) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait for RAP processes");
+			return NULL;
+		}
+		for (int i = 0; i < eventCount; i++) {
+			int pid = (int) (uint32_t) events[i].data.u64;
+			int pidFd = (int) (events[i].data.u64 >> 32);
+
+			// Invalidate the RAP before reaping it so that its pid can not be re-used while still registered
+			if (sem_wait(&rapRegistryLock) == -1) {
+				stdLogError(errno, "Could not wait for rap registry lock while reaping rap");
+			} else {
+				RAP toFind = { .pid = pid };
+				RAP ** found = tfind(&toFind, &rapProcesses, &compareRapPid);
+				if (found) {
+					RAP * rapSession = *found;
+					rapSession->exited = 1;
+					tdelete(rapSession, &rapProcesses, &compareRapPid);
+				}
+				sem_post(&rapRegistryLock);
+			}
+
+			epoll_ctl(reaperEpollFd, EPOLL_CTL_DEL, pidFd, NULL);
+			close(pidFd);
+			int status;
+			if (waitpid(pid, &status, 0) == -1) {
+				stdLogError(errno, "Could not reap RAP %d", pid);
+			} else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV) {
+				stdLogError(0, "RAP %d failed with segmentation fault", pid);
+			}
+			//stdLog("Child finished PID: %d staus: %d", pid, status);
+		}
 	}
-	//stdLog("Child finished PID: %d staus: %d", siginfo->si_pid, status);
 }
 
 static void deInitializeRapDatabase(void * data) {
@@ -611,7 +1278,8 @@ static void deInitializeRapDatabase(void * data) {
 }
 
 static void runCleanRapPool() {
-	time_t expires = getExpiryTime();
+	time_t now;
+	time(&now);
 	if (sem_wait(&rapPoolLock) == -1) {
 		stdLogError(errno, "Could not wait for rap pool lock while cleaning pool");
 		return;
@@ -619,7 +1287,7 @@ static void runCleanRapPool() {
 		RAP * rap = rapPool.firstRapSession;
 		while (rap != NULL) {
 			RAP * next = rap->next;
-			if (rap->rapCreated < expires) {
+			if (rapExpired(rap, now)) {
 				destroyRap(rap);
 			}
 			rap = next;
@@ -628,16 +1296,150 @@ static void runCleanRapPool() {
 	}
 }
 
-static void initializeRapDatabase() {
-	struct sigaction childCleanup = { .sa_sigaction = &cleanupAfterRap, .sa_flags = SA_SIGINFO };
-	if (sigaction(SIGCHLD, &childCleanup, NULL) < 0) {
-		stdLogError(errno, "Could not set handler method for finished child threads");
-		exit(255);
+// Evicts the least recently used half of the idle RAPs in the pool.
+static void runEvictIdleRaps() {
+	if (sem_wait(&rapPoolLock) == -1) {
+		stdLogError(errno, "Could not wait for rap pool lock while evicting raps");
+		return;
+	}
+	int pooled = 0;
+	for (RAP * rap = rapPool.firstRapSession; rap; rap = rap->next) {
+		pooled++;
+	}
+	for (int i = (pooled + 1) / 2; i > 0; i--) {
+		destroyRap(findLeastRecentlyUsedRap(NULL));
+	}
+	sem_post(&rapPoolLock);
+	if (pooled) {
+		stdLog("Memory pressure: evicted %d of %d idle sessions", (pooled + 1) / 2, pooled);
+	}
+}
+
+// Opens a file which will signal POLLPRI when the system is under memory pressure.  The cgroup's own pressure
+// file is preferred so that memory limits placed on the service are respected.  Returns -1 if none are available.
+static int openMemoryPressureFile() {
+	char cgroupPath[1024] = "";
+	FILE * cgroupFile = fopen("/proc/self/cgroup", "re");
+	if (cgroupFile) {
+		char line[900];
+		while (fgets(line, sizeof(line), cgroupFile)) {
+			if (!strncmp(line, "0::", 3)) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(cgroupPath, sizeof(cgroupPath), "/sys/fs/cgroup%s", line + 3);
+				break;
+			}
+		}
+		fclose(cgroupFile);
+	}
+
+	char fileName[1100];
+	int fd;
+	if (cgroupPath[0]) {
+		snprintf(fileName, sizeof(fileName), "%s/memory.pressure", cgroupPath);
+		fd = open(fileName, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (fd != -1 && write(fd, MEMORY_PRESSURE_TRIGGER, sizeof(MEMORY_PRESSURE_TRIGGER)) > 0) {
+			return fd;
+		}
+		if (fd != -1) close(fd);
+	}
+
+	fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd != -1 && write(fd, MEMORY_PRESSURE_TRIGGER, sizeof(MEMORY_PRESSURE_TRIGGER)) > 0) {
+		return fd;
+	}
+	if (fd != -1) close(fd);
+
+	// Without PSI fall back to cgroup memory events (high / max / oom) which are also signalled with POLLPRI
+	if (cgroupPath[0]) {
+		snprintf(fileName, sizeof(fileName), "%s/memory.events", cgroupPath);
+		fd = open(fileName, O_RDONLY | O_CLOEXEC);
+		if (fd != -1) {
+			char ignored[1024];
+			if (read(fd, ignored, sizeof(ignored)) >= 0) {
+				return fd;
+			}
+			close(fd);
+		}
+	}
+	return -1;
+}
+
+static void * memoryPressureMonitor(void * ignored) {
+	int fd = openMemoryPressureFile();
+	if (fd == -1) {
+		stdLogError(errno, "Memory pressure monitoring is not available, idle sessions will only be evicted by age");
+		return NULL;
 	}
 
+	struct pollfd pressure = { .fd = fd, .events = POLLPRI };
+	while (!shuttingDown) {
+		if (poll(&pressure, 1, -1) == -1) {
+			if (errno == EINTR) continue;
+			stdLogError(errno, "Could not wait for memory pressure");
+			break;
+		}
+		if (pressure.revents & POLLPRI) {
+			// memory.events must be re-read before it will signal again
+			char buffer[1024];
+			if (lseek(fd, 0, SEEK_SET) == 0) {
+				size_t ignored __attribute__ ((unused)) = read(fd, buffer, sizeof(buffer));
+			}
+			runEvictIdleRaps();
+		} else if (pressure.revents & (POLLERR | POLLNVAL)) {
+			stdLogError(0, "Memory pressure monitor was closed");
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void initializeRapDatabase() {
+	// RAPs are reaped by a dedicated thread so SIGCHLD is never delivered to (and never interrupts) any thread.
+	// This must happen before any other threads are started so they inherit the mask.
+	sigset_t childSignals;
+	sigemptyset(&childSignals);
+	sigaddset(&childSignals, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &childSignals, NULL);
+
 	memset(&rapPool, 0, sizeof(rapPool));
 	sem_init(&rapPoolLock, 0, 1);
+	sem_init(&rapRegistryLock, 0, 1);
+	sem_init(&authFailureLock, 0, 1);
+	if (gnutls_rnd(GNUTLS_RND_KEY, credentialSalt, sizeof(credentialSalt))) {
+		stdLogError(0, "Could not generate credential salt");
+		exit(255);
+	}
 	pthread_key_create(&rapDBThreadKey, &deInitializeRapDatabase);
+
+	int testPidFd = pidfd_open(getpid(), 0);
+	if (testPidFd != -1) {
+		close(testPidFd);
+		reaperEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	}
+	pthread_t reaperThread;
+	if (reaperEpollFd == -1 || pthread_create(&reaperThread, NULL, &rapReaper, NULL)) {
+		// Without pidfds let the kernel reap children.  Dead RAPs will then only be noticed when their socket fails.
+		stdLogError(errno, "Could not start RAP reaper, falling back to automatic reaping");
+		if (reaperEpollFd != -1) {
+			close(reaperEpollFd);
+			reaperEpollFd = -1;
+		}
+		struct sigaction childCleanup = { .sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT };
+		if (sigaction(SIGCHLD, &childCleanup, NULL) < 0) {
+			stdLogError(errno, "Could not set handler method for finished child threads");
+			exit(255);
+		}
+	} else {
+		pthread_detach(reaperThread);
+	}
+
+	pthread_t monitorThread;
+	if (pthread_create(&monitorThread, NULL, &memoryPressureMonitor, NULL)) {
+		stdLogError(errno, "Could not start memory pressure monitor");
+	} else {
+		pthread_detach(monitorThread);
+	}
 }
 
 ////////////////////////
@@ -829,6 +1631,69 @@ static int loadSSLCertificate(SSLConfig * sslConfig) {
 	return 0;
 }
 
+// Finds the user mapped to the subject of a client certificate.
+static const char * findCertificateUser(const char * subject) {
+	for (int i = 0; i < config.certificateUserCount; i++) {
+		if (!strcmp(subject, config.certificateUsers[i].subject)) {
+			return config.certificateUsers[i].user;
+		}
+	}
+	return NULL;
+}
+
+// Identifies the user by the client's certificate (if any).  The certificate must be trusted by the listener's
+// client-ca and its subject must be mapped to a user in the configuration.  The certificate's SHA-256 fingerprint
+// is written (in hex) to fingerprint.  Returns NULL if there is no usable certificate.
+static const char * getCertificateUser(Request * request, char * fingerprint) {
+	const union MHD_ConnectionInfo * info = MHD_get_connection_info(request, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+	if (!info || !info->tls_session) {
+		return NULL;
+	}
+	gnutls_session_t session = (gnutls_session_t) info->tls_session;
+	unsigned int certificateCount = 0;
+	const gnutls_datum_t * certificates = gnutls_certificate_get_peers(session, &certificateCount);
+	if (!certificates || !certificateCount) {
+		return NULL;
+	}
+
+	unsigned int status;
+	int result = gnutls_certificate_verify_peers2(session, &status);
+	if (result != GNUTLS_E_SUCCESS || status) {
+		stdLogError(0, "Rejecting client certificate: %s",
+				result != GNUTLS_E_SUCCESS ? gnutls_strerror(result) : "not trusted");
+		return NULL;
+	}
+
+	gnutls_x509_crt_t certificate;
+	if (gnutls_x509_crt_init(&certificate) != GNUTLS_E_SUCCESS) {
+		return NULL;
+	}
+	const char * user = NULL;
+	gnutls_datum_t subject = { .data = NULL, .size = 0 };
+	unsigned char rawFingerprint[CERTIFICATE_FINGERPRINT_LENGTH / 2];
+	size_t rawFingerprintSize = sizeof(rawFingerprint);
+	if ((result = gnutls_x509_crt_import(certificate, &certificates[0], GNUTLS_X509_FMT_DER)) != GNUTLS_E_SUCCESS
+			|| (result = gnutls_x509_crt_get_dn2(certificate, &subject)) != GNUTLS_E_SUCCESS
+			|| (result = gnutls_x509_crt_get_fingerprint(certificate, GNUTLS_DIG_SHA256, rawFingerprint,
+					&rawFingerprintSize)) != GNUTLS_E_SUCCESS) {
+		stdLogError(0, "Could not read client certificate: %s", gnutls_strerror(result));
+	} else {
+		user = findCertificateUser((const char *) subject.data);
+		if (user) {
+			for (int i = 0; i < rawFingerprintSize; i++) {
+				sprintf(fingerprint + i * 2, "%02x", rawFingerprint[i]);
+			}
+		} else {
+			stdLogError(0, "No user is mapped to client certificate %s", subject.data);
+		}
+	}
+	if (subject.data) {
+		gnutls_free(subject.data);
+	}
+	gnutls_x509_crt_deinit(certificate);
+	return user;
+}
+
 static void initializeSSL() {
 	for (int i = 0; i < config.sslCertCount; i++) {
 		if (loadSSLCertificate(&config.sslCerts[i])) {
@@ -1291,6 +2156,7 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 	}
 
 	if (message->fd == -1) {
+		*response = NULL;
 		switch (statusCode) {
 		case RAP_RESPOND_OK:
 			statusCode = RAP_RESPOND_OK_NO_CONTENT;
@@ -1316,6 +2182,16 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 			*response = createFileResponse(CONFLICT_PAGE, "text/html", session);
 			break;
 
+		case RAP_RESPOND_NOT_MODIFIED:
+			*response = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+			if (!*response) {
+				stdLogError(errno, "Could not create response");
+				exit(255);
+			}
+			// Nothing is sent from the RAP so any locks used by the request can be released now
+			unuseSessionLocks(session);
+			break;
+
 		default:
 			*response = 0;
 		}
@@ -1350,6 +2226,10 @@ static int createResponseFromMessage(Request * request, Message * message, Respo
 			*response = createFdResponse(message->fd, 0, -1, mimeType, date, session);
 		}
 	}
+	if (*response && message->paramCount > RAP_PARAM_RESPONSE_ETAG
+			&& message->params[RAP_PARAM_RESPONSE_ETAG].iov_len) {
+		addHeader(*response, "ETag", messageParamToString(&message->params[RAP_PARAM_RESPONSE_ETAG]));
+	}
 	return statusCode;
 }
 
@@ -1359,8 +2239,8 @@ static RapConstant writeErrorResponse(RapConstant responseCode, const char * tex
 	message.params[RAP_PARAM_ERROR_LOCATION] = stringToMessageParam(file);
 	message.params[RAP_PARAM_ERROR_DAV_REASON] = stringToMessageParam(error);
 	message.params[RAP_PARAM_ERROR_REASON] = stringToMessageParam(textError);
-	char buffer[BUFFER_SIZE];
-	if (sendRecvMessage(session->socketFd, &message, buffer, BUFFER_SIZE) <= 0) {
+	char buffer[INCOMING_BUFFER_SIZE];
+	if (sendRecvMessage(session->socketFd, &message, buffer, INCOMING_BUFFER_SIZE) <= 0) {
 		return RAP_RESPOND_INTERNAL_ERROR;
 	} else {
 		return createResponseFromMessage(NULL, &message, response, session);
@@ -1457,15 +2337,23 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 		message.paramCount = 2;
 	} else if (!strcmp("PUT", method)) {
 		message.mID = RAP_REQUEST_PUT;
-		message.paramCount = 2;
+		message.paramCount = 4;
+		message.params[RAP_PARAM_REQUEST_LENGTH] = stringToMessageParam(getHeader(request, "Content-Length"));
+		message.params[RAP_PARAM_REQUEST_RANGE] = stringToMessageParam(getHeader(request, "Content-Range"));
 	} else if (!strcmp("PROPFIND", method)) {
 		message.mID = RAP_REQUEST_PROPFIND;
-		message.paramCount = 3;
+		message.paramCount = 4;
 		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
+		message.params[RAP_PARAM_REQUEST_IF_NONE_MATCH] = stringToMessageParam(
+				getHeader(request, "If-None-Match"));
 	} else if (!strcmp("PROPPATCH", method)) {
 		message.mID = RAP_REQUEST_PROPPATCH;
 		message.paramCount = 3;
 		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
+	} else if (!strcmp("REPORT", method)) {
+		message.mID = RAP_REQUEST_REPORT;
+		message.paramCount = 3;
+		message.params[RAP_PARAM_REQUEST_DEPTH] = stringToMessageParam(getHeader(request, HEADER_DEPTH));
 	} else if (!strcmp("MKCOL", method)) {
 		message.mID = RAP_REQUEST_MKCOL;
 		message.paramCount = 2;
@@ -1586,6 +2474,13 @@ static int startProcessingRequest(Request * request, const char * url, const cha
 
 static int sendResponse(Request * request, int statusCode, Response * response, RAP * rapSession) {
 	if (response) {
+		if (AUTH_SUCCESS(rapSession) && rapSession->requestIssueToken && rapSession->sessionToken[0]) {
+			char cookie[sizeof(SESSION_COOKIE_NAME) + SESSION_TOKEN_LENGTH + 64];
+			snprintf(cookie, sizeof(cookie), SESSION_COOKIE_NAME "=%s; Path=/; HttpOnly; SameSite=Strict%s",
+					rapSession->sessionToken,
+					rapSession->requestIssueToken == SESSION_COOKIE_SECURE ? "; Secure" : "");
+			addHeader(response, "Set-Cookie", cookie);
+		}
 		int queueResult = MHD_queue_response(request, statusCode, response);
 		MHD_destroy_response(response);
 		return queueResult;
@@ -1611,6 +2506,10 @@ static int sendResponse(Request * request, int statusCode, Response * response,
 			response = METHOD_NOT_SUPPORTED_PAGE;
 			break;
 
+		case MHD_HTTP_SERVICE_UNAVAILABLE:
+			response = SERVICE_UNAVAILABLE_PAGE;
+			break;
+
 		default:
 			response = NO_CONTENT_PAGE;
 		}
@@ -1657,7 +2556,16 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 		if (*upload_data_size) {
 			// Uploading more data
 			if (rapSession->requestWriteDataFd != -1) {
-				size_t bytesWritten = write(rapSession->requestWriteDataFd, upload_data, *upload_data_size);
+				// MHD reuses upload_data as soon as we return so it must be copied into the pipe with write().
+				// vmsplice() would only lend the pages to the pipe and the rap could then read overwritten data.
+				size_t bytesWritten = 0;
+				while (bytesWritten < *upload_data_size) {
+					ssize_t result = write(rapSession->requestWriteDataFd, upload_data + bytesWritten,
+							*upload_data_size - bytesWritten);
+					if (result == -1 && errno == EINTR) continue;
+					if (result <= 0) break;
+					bytesWritten += result;
+				}
 				if (bytesWritten < *upload_data_size) {
 					// not all data could be written to the file handle and therefore
 					// the operation has now failed. There's nothing we can do now but report the error
@@ -1694,27 +2602,53 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 		}
 	} else {
 		// All requests must be Authenticated
-		char * password;
-		char * user = MHD_basic_auth_get_username_password(request, &password);
 		char clientIp[100];
 		getRequestIP(clientIp, sizeof(clientIp), request);
-		rapSession = acquireRap(user, password, clientIp);
+		rapSession = NULL;
+		if (((DaemonConfig *) cls)->clientCAFile) {
+			char fingerprint[CERTIFICATE_FINGERPRINT_LENGTH + 1];
+			const char * user = getCertificateUser(request, fingerprint);
+			if (user) {
+				rapSession = acquireRap(user, NULL, fingerprint, clientIp);
+			}
+		}
+		if (!rapSession && !getHeader(request, "Authorization")) {
+			// The session cookie only stands in for credentials the client didn't send.  Credentials that are sent
+			// always win so that a client switching user is never served as the owner of an old cookie.
+			rapSession = acquireRapByToken(
+					MHD_lookup_connection_value(request, MHD_COOKIE_KIND, SESSION_COOKIE_NAME), clientIp);
+		}
+		if (rapSession) {
+			rapSession->requestIssueToken = 0;
+		} else {
+			char * password;
+			char * user = MHD_basic_auth_get_username_password(request, &password);
+			rapSession = acquireRap(user, password, NULL, clientIp);
+			if (user) free(user);
+			if (password) free(password);
+			if (AUTH_SUCCESS(rapSession)) {
+				rapSession->requestIssueToken = ((DaemonConfig *) cls)->sslEnabled ?
+						SESSION_COOKIE_SECURE : SESSION_COOKIE;
+			}
+		}
 		*s = rapSession;
 		if (AUTH_SUCCESS(rapSession)) {
 			if (requestHasData(request)) {
-				// If we have data to send then create a pipe to pump it through
-				// To avoid the "non-standard" pipe2() we use unix domain sockets with socketpair
-				// this let us set it as a close on exec
+				// If we have data to send then create a pipe to pump it through.  A real pipe (rather than a
+				// socket) lets the rap splice() the data straight into the target file.
 				int pipeEnds[2];
-				if (socketpair(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0, pipeEnds)) {
+				if (pipe2(pipeEnds, O_CLOEXEC)) {
 					stdLogError(errno, "Could not create write pipe");
 					rapSession->requestResponseAlreadyGiven = RAP_RESPOND_INTERNAL_ERROR;
 					rapSession->requestResponseObjectAlreadyGiven = NULL;
 					logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
 					return MHD_YES;
 				}
-				rapSession->requestReadDataFd = pipeEnds[CHILD_SOCKET];
-				rapSession->requestWriteDataFd = pipeEnds[PARENT_SOCKET];
+				// A bigger pipe means fewer context switches between us and the rap. This is only a hint and
+				// may be refused by fs.pipe-max-size or the user's pipe quota.
+				fcntl(pipeEnds[PIPE_WRITE], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+				rapSession->requestReadDataFd = pipeEnds[PIPE_READ];
+				rapSession->requestWriteDataFd = pipeEnds[PIPE_WRITE];
 
 				Response * response = NULL;
 				int statusCode = startProcessingRequest(request, url, method, rapSession, &response);
@@ -1734,9 +2668,20 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 						close(rapSession->requestWriteDataFd);
 						rapSession->requestWriteDataFd = -1;
 					}
+					logAccess(statusCode, method, rapSession->user, url, clientIp);
+					if (requestExpectsContinue(request)) {
+						// The client is still waiting for permission to send the body, so refuse it now rather
+						// than have it upload everything only to be told no.
+						int ret = sendResponse(request, statusCode, response, rapSession);
+						if (statusCode == RAP_RESPOND_INTERNAL_ERROR) {
+							destroyRap(rapSession);
+						} else {
+							releaseRap(rapSession);
+						}
+						return ret;
+					}
 					rapSession->requestResponseAlreadyGiven = statusCode;
 					rapSession->requestResponseObjectAlreadyGiven = response;
-					logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
 					return MHD_YES;
 				}
 			} else {
@@ -1774,6 +2719,13 @@ static int answerToRequest(void *cls, Request *request, const char *url, const c
 			} else {
 				return sendResponse(request, RAP_RESPOND_AUTH_FAILLED, NULL, rapSession);
 			}
+		} else if (rapSession == AUTH_BUSY) {
+			logAccess(MHD_HTTP_SERVICE_UNAVAILABLE, method, rapSession->user, url, clientIp);
+			if (requestHasData(request)) {
+				return MHD_YES;
+			} else {
+				return sendResponse(request, MHD_HTTP_SERVICE_UNAVAILABLE, NULL, rapSession);
+			}
 		} else /*if (*rapSession == AUTH_ERROR)*/{
 			logAccess(RAP_RESPOND_INTERNAL_ERROR, method, rapSession->user, url, clientIp);
 			if (requestHasData(request)) {
@@ -1878,6 +2830,11 @@ static void initializeStaticResponses() {
 	addHeader(METHOD_NOT_SUPPORTED_PAGE, "Allow", ACCEPT_HEADER);
 	freeSafe(string);
 
+	string = createStaticFileName("HTTP_SERVICE_UNAVAILABLE.html");
+	initializeStaticResponse(&SERVICE_UNAVAILABLE_PAGE, string, "text/html");
+	addHeader(SERVICE_UNAVAILABLE_PAGE, "Retry-After", "30");
+	freeSafe(string);
+
 	NO_CONTENT_PAGE = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_MUST_COPY);
 
 	FORBIDDEN_PAGE = createStaticFileName("HTTP_FORBIDDEN.html");
@@ -1894,6 +2851,25 @@ static void initializeEnvVariables() {
 	setenv("WEBDAVD_MIME_FILE", config.mimeTypesFile, 1);
 	if (config.chrootPath) setenv("WEBDAVD_CHROOT_PATH", config.chrootPath, 1);
 	else unsetenv("WEBDAVD_CHROOT_PATH");
+	setenv("WEBDAVD_IPC_TRANSPORT", config.rapSharedMemory ? "shared-memory" : "socket", 1);
+	setenv("WEBDAVD_DURABILITY", config.durability, 1);
+	char maxEntries[20];
+	snprintf(maxEntries, sizeof(maxEntries), "%d", config.propFindMaxEntries);
+	setenv("WEBDAVD_PROPFIND_MAX_ENTRIES", maxEntries, 1);
+}
+
+// Must be called after initializeEnvVariables() as spare RAPs read their configuration from the environment.
+static void initializeAuthWorkers() {
+	sem_init(&authSlots, 0, config.maxConcurrentAuth);
+	sem_init(&spareRapLock, 0, 1);
+	sem_init(&spareRapWanted, 0, config.authWorkers);
+	spareRaps = mallocSafe(sizeof(*spareRaps) * config.authWorkers);
+	pthread_t fillerThread;
+	if (pthread_create(&fillerThread, NULL, &spareRapFiller, NULL)) {
+		stdLogError(errno, "Could not start spare rap thread, RAPs will be started on demand");
+	} else {
+		pthread_detach(fillerThread);
+	}
 }
 
 ////////////////////////
@@ -1936,6 +2912,7 @@ void cleaner() {
 			total = sleep(total);
 		while (total > 0);
 		runCleanRapPool();
+		runCleanAuthFailures();
 		runCleanLocks();
 	}
 }
@@ -1945,12 +2922,16 @@ static void runServer() {
 		exit(1);
 	}
 
+	// A rap closing its end of an upload pipe early must not take the whole server down
+	signal(SIGPIPE, SIG_IGN);
+
 	initializeLogs();
 	initializeStaticResponses();
 	initializeRapDatabase();
 	initializeLockDB();
 	initializeSSL();
 	initializeEnvVariables();
+	initializeAuthWorkers();
 
 	// Start up the daemons
 	daemons = mallocSafe(sizeof(*daemons) * config.daemonCount);
@@ -1971,12 +2952,24 @@ static void runServer() {
 							config.daemons[i].host ? config.daemons[i].host : "", config.daemons[i].port);
 					continue;
 				}
+				// Setting a trust list makes libmicrohttpd request (but not require) a client certificate
+				char * clientCA = NULL;
+				if (config.daemons[i].clientCAFile) {
+					size_t clientCASize;
+					clientCA = loadFileToBuffer(config.daemons[i].clientCAFile, &clientCASize);
+					if (!clientCA) {
+						continue;
+					}
+					clientCA = reallocSafe(clientCA, clientCASize + 1);
+					clientCA[clientCASize] = '\0';
+				}
 				daemons[i] = MHD_start_daemon(
 						MHD_USE_THREAD_PER_CONNECTION | MHD_USE_DUAL_STACK | MHD_USE_PEDANTIC_CHECKS
 								| MHD_USE_SSL, 0 /* ignored */, NULL, NULL,                     //
 						callback, &config.daemons[i],                    //
 						MHD_OPTION_SOCK_ADDR, &address,                  // Specifies both host and port
 						MHD_OPTION_HTTPS_CERT_CALLBACK, &sslSNICallback, // enable ssl
+						MHD_OPTION_HTTPS_MEM_TRUST, clientCA,            // client certificates (may be NULL)
 						MHD_OPTION_PER_IP_CONNECTION_LIMIT, config.maxConnectionsPerIp, //
 						MHD_OPTION_END);
 			} else {
@@ -2,9 +2,11 @@
 
 #include "shared.h"
 
+#include <errno.h>
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 ////////////////
 // XML Reader //
@@ -130,23 +132,78 @@ const char * nodeTypeToName(int nodeType) {
 // XML Text Writer //
 /////////////////////
 
-static int xmlFdOutputCloseCallback(void * context) {
-	close(*((int *) context));
-	freeSafe(context);
+// Writes every byte of iov to fd with as few system calls as possible, carrying on after short writes.  Returns
+// 0 on success or -1 with errno set (eg: EPIPE when the reader has gone away).
+static int writeVectorFully(int fd, struct iovec * iov, int iovCount) {
+	while (iovCount) {
+		ssize_t written = writev(fd, iov, iovCount);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		while (iovCount && written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovCount--;
+		}
+		if (iovCount) {
+			iov->iov_base = (char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
 	return 0;
 }
 
+// libxml2 hands its output over a few KiB at a time.  This gathers it up so the pipe sees one write per
+// XML_STREAM_BUFFER_SIZE rather than one per libxml2 flush.
+typedef struct FdOutput {
+	int fd;
+	int failed;
+	size_t used;
+	char buffer[XML_STREAM_BUFFER_SIZE];
+} FdOutput;
+
+static int xmlFdOutputCloseCallback(void * context) {
+	FdOutput * output = context;
+	int result = 0;
+	if (!output->failed && output->used) {
+		struct iovec iov = { .iov_base = output->buffer, .iov_len = output->used };
+		result = writeVectorFully(output->fd, &iov, 1);
+	}
+	close(output->fd);
+	freeSafe(output);
+	return result;
+}
+
 static int xmlFdOutputWriteCallback(void * context, const char * buffer, int len) {
-	ssize_t ignored = write(*((int *) context), buffer, len);
-	return ignored;
+	FdOutput * output = context;
+	if (output->failed) return -1;
+	if (output->used + len <= sizeof(output->buffer)) {
+		memcpy(output->buffer + output->used, buffer, len);
+		output->used += len;
+		return len;
+	}
+	struct iovec iov[2] = {
+			{ .iov_base = output->buffer, .iov_len = output->used },
+			{ .iov_base = (void *) buffer, .iov_len = len } };
+	output->used = 0;
+	if (writeVectorFully(output->fd, iov, 2)) {
+		// Nobody is listening any more, tell libxml2 to stop generating output
+		output->failed = 1;
+		return -1;
+	}
+	return len;
 }
 
 xmlTextWriterPtr xmlNewFdTextWriter(int out) {
 	xmlOutputBufferPtr outStruct = xmlAllocOutputBuffer(NULL);
+	FdOutput * output = mallocSafe(sizeof(*output));
+	output->fd = out;
+	output->failed = 0;
+	output->used = 0;
 	outStruct->writecallback = &xmlFdOutputWriteCallback;
 	outStruct->closecallback = &xmlFdOutputCloseCallback;
-	outStruct->context = mallocSafe(sizeof(int));
-	*((int *) outStruct->context) = out;
+	outStruct->context = output;
 	return xmlNewTextWriter(outStruct);
 }
 
@@ -193,3 +250,136 @@ void xmlTextWriterWriteURL(xmlTextWriterPtr writer, const char * url) {
 // End XML Text Writer //
 /////////////////////////
 
+////////////////
+// XML Stream //
+////////////////
+
+XmlStream * xmlStreamNew(int out, XmlWriterCopy * copy) {
+	XmlStream * stream = mallocSafe(sizeof(*stream));
+	stream->fd = out;
+	stream->failed = 0;
+	stream->copy = copy;
+	stream->used = 0;
+	return stream;
+}
+
+static void xmlStreamCopy(XmlWriterCopy * copy, const char * buffer, size_t size) {
+	if (copy->size + size > copy->maxSize) {
+		copy->overflowed = 1;
+		freeSafe(copy->data);
+		copy->data = NULL;
+		copy->size = 0;
+	} else {
+		copy->data = reallocSafe(copy->data, copy->size + size);
+		memcpy(copy->data + copy->size, buffer, size);
+		copy->size += size;
+	}
+}
+
+// Sends the buffer followed by data (which may be NULL) in a single writev().
+static void xmlStreamOutput(XmlStream * stream, const char * data, size_t size) {
+	if (stream->copy && !stream->copy->overflowed) {
+		xmlStreamCopy(stream->copy, stream->buffer, stream->used);
+		if (size && !stream->copy->overflowed) xmlStreamCopy(stream->copy, data, size);
+	}
+	struct iovec iov[2] = {
+			{ .iov_base = stream->buffer, .iov_len = stream->used },
+			{ .iov_base = (void *) data, .iov_len = size } };
+	stream->used = 0;
+	// Once the reader has gone away the rest of the response is generated (it may be cached) but not sent
+	if (stream->fd != -1 && !stream->failed && writeVectorFully(stream->fd, iov, size ? 2 : 1)) {
+		stream->failed = 1;
+	}
+}
+
+void xmlStreamFlush(XmlStream * stream) {
+	if (stream->used) xmlStreamOutput(stream, NULL, 0);
+}
+
+void xmlStreamWrite(XmlStream * stream, const char * data, size_t size) {
+	if (size > sizeof(stream->buffer) - stream->used) {
+		if (size > sizeof(stream->buffer)) {
+			xmlStreamOutput(stream, data, size);
+			return;
+		}
+		xmlStreamFlush(stream);
+	}
+	memcpy(stream->buffer + stream->used, data, size);
+	stream->used += size;
+}
+
+void xmlStreamWriteText(XmlStream * stream, const char * text) {
+	const char * run = text;
+	for (;; text++) {
+		const char * entity;
+		size_t entitySize;
+		switch (*text) {
+		case '\0':
+			xmlStreamWrite(stream, run, text - run);
+			return;
+		case '&':
+			entity = "&amp;";
+			entitySize = 5;
+			break;
+		case '<':
+			entity = "&lt;";
+			entitySize = 4;
+			break;
+		case '>':
+			entity = "&gt;";
+			entitySize = 4;
+			break;
+		case '"':
+			entity = "&quot;";
+			entitySize = 6;
+			break;
+		default:
+			continue;
+		}
+		xmlStreamWrite(stream, run, text - run);
+		xmlStreamWrite(stream, entity, entitySize);
+		run = text + 1;
+	}
+}
+
+void xmlStreamWriteURL(XmlStream * stream, const char * url) {
+	static const char * lookup = "0123456789ABCDEF";
+	unsigned char c;
+	while ((c = *(url++))) {
+		if (sizeof(stream->buffer) - stream->used < 3) xmlStreamFlush(stream);
+		char * writePtr = stream->buffer + stream->used;
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '_'
+				|| c == '.' || c == '~' || c == '/') {
+			*writePtr = c;
+			stream->used++;
+		} else {
+			writePtr[0] = '%';
+			writePtr[1] = lookup[(c & 0xF0) >> 4];
+			writePtr[2] = lookup[c & 0x0F];
+			stream->used += 3;
+		}
+	}
+}
+
+void xmlStreamWriteInteger(XmlStream * stream, long long value) {
+	char buffer[24];
+	char * ptr = buffer + sizeof(buffer);
+	unsigned long long magnitude = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+	do {
+		*(--ptr) = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+	if (value < 0) *(--ptr) = '-';
+	xmlStreamWrite(stream, ptr, buffer + sizeof(buffer) - ptr);
+}
+
+void xmlStreamFree(XmlStream * stream) {
+	xmlStreamFlush(stream);
+	if (stream->fd != -1) close(stream->fd);
+	freeSafe(stream);
+}
+
+////////////////////
+// End XML Stream //
+////////////////////
+
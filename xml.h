@@ -16,9 +16,43 @@ int elementMatches(xmlTextReaderPtr reader, const char * namespace, const char *
 const char * nodeTypeToName(int nodeType);
 
 // XML Writer
+// Output is buffered and sent in XML_STREAM_BUFFER_SIZE writes.  The fd is closed when the writer is freed.
 xmlTextWriterPtr xmlNewFdTextWriter(int out);
 int xmlTextWriterWriteElementString(xmlTextWriterPtr writer, const char * prefix, const char * elementName,
 		const char * string);
 void xmlTextWriterWriteURL(xmlTextWriterPtr writer, const char * url);
 
+#define XML_STREAM_BUFFER_SIZE 65536
+
+// XML Stream
+// A buffered writer for large generated responses (eg: PROPFIND).  Unlike xmlTextWriter it keeps no element stack
+// and does no checking: callers write ready made tag fragments and only text and URLs are escaped.
+
+// Optionally keeps a copy of everything written, giving up (and freeing data) if it grows beyond maxSize.
+typedef struct XmlWriterCopy {
+	char * data;
+	size_t size;
+	size_t maxSize;
+	int overflowed;
+} XmlWriterCopy;
+
+typedef struct XmlStream {
+	int fd;
+	int failed;
+	XmlWriterCopy * copy;
+	size_t used;
+	char buffer[XML_STREAM_BUFFER_SIZE];
+} XmlStream;
+
+// out may be -1 to only build the copy in memory
+XmlStream * xmlStreamNew(int out, XmlWriterCopy * copy);
+void xmlStreamWrite(XmlStream * stream, const char * data, size_t size);
+#define xmlStreamWriteLiteral(stream, literal) xmlStreamWrite((stream), (literal), sizeof(literal) - 1)
+void xmlStreamWriteText(XmlStream * stream, const char * text);
+void xmlStreamWriteURL(XmlStream * stream, const char * url);
+void xmlStreamWriteInteger(XmlStream * stream, long long value);
+void xmlStreamFlush(XmlStream * stream);
+// Flushes and closes the file descriptor
+void xmlStreamFree(XmlStream * stream);
+
 #endif